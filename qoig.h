@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 //Fast lossless image compression and decompression based on QOI
 //https://qoiformat.org/qoi-specification.pdf
@@ -20,6 +23,18 @@
   2. long runs
   3. secondary cache 
   4. raw blocks (rgb runs)
+  5. entropy coded blocks (QOIG+)
+  6. gray mode
+  7. seeded caches and dictionaries
+  8. checksums
+  9. alpha changes
+  10. big cache
+  11. state trailer (appendable files)
+  12. color transform
+
+  None of this has to be lossless to use. With cfg.tolerance set, the encoder
+  lets each color channel drift by up to that much when it makes for a shorter 
+  code (see qoig_snap). The output is an ordinary file for any decoder.
 
   1. SPLIT CACHE
   The first difference is that the cache can be split into two parts.
@@ -114,9 +129,256 @@
   
   The third most significant bit of the fourth byte of the file is set to DISable 
   this feature.
+  
+  HEADER EXTENSIONS
+  The fourth byte of the file has no room left, so further features are flagged
+  in the upper seven bits of the colorspace byte (the last byte of the header). 
+  Only the lowest bit of that byte is the colorspace. A plain QOI file has these 
+  bits clear. A decoder must refuse a file with a flag it doesn't know.
+  
+  The highest of them says that a byte of more flags follows the header, ahead
+  of any other bytes a feature keeps there (big cache size, seed block). The 
+  highest bit of that byte says the same of another byte after it. No features
+  use that yet, so for now a decoder refuses it like any other unknown flag.
+  
+  5. ENTROPY CODED BLOCKS (QOIG+)
+  The byte codes above still compress another 20-40% with a general purpose 
+  compressor. Rather than pay for deflate, QOIG+ splits everything after the 
+  header (byte codes and footer) into blocks of up to 32768 bytes and codes 
+  each with its own canonical Huffman code, at most 12 bits per symbol. Each 
+  block starts with its length and a type byte:
+  
+  ┌─ BLOCK ─────────────────┬──────────┬──────────────────────────────────────┐
+  │  length (16 bits, BE)   │   type   │  type 0: length stored bytes         │
+  │                         │          │  type 1: 128 bytes of 4-bit code     │
+  │                         │          │   lengths (symbol 2i in the high     │
+  │                         │          │   nibble of byte i), 16-bit BE size  │
+  │                         │          │   of the bitstream, then the         │
+  │                         │          │   bitstream, least significant bit   │
+  │                         │          │   first                              │
+  └─────────────────────────┴──────────┴──────────────────────────────────────┘
+  
+  A length of zero (two zero bytes, no type) ends the stream. Since every 
+  table is local to its block, a streaming decoder only ever holds one block.
+  
+  The second lowest bit of the colorspace byte is set to enable this feature.
+  
+  6. GRAY MODE
+  Grayscale scans and masks would waste most of the RGB predictor: every OP_RGB
+  carries three identical bytes and OP_DIFF and OP_LUMA spend bits on channels
+  that can't differ. When the channels byte of the header is 1 (gray) or 2 (gray
+  and alpha) the same four kinds of byte codes are read differently. Runs, long 
+  runs and the exact-match cache (hashed as if gray were red and alpha were 
+  green) work as before. The secondary caches are never used in gray mode, so
+  the second flag bit of the fourth byte is ignored.
+  
+  ┌─ OP_GRAY_DIFF ─────────┐ ┌─ OP_GRAY_LUMA ─────────┬────────────────────────┐
+  │         Byte[0]        │ │         Byte[0]        │         Byte[1]        │
+  │ 7  6  5  4  3  2  1  0 │ │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+  │───────┼────────────────│ │───────┼────────────────┼────────────────────────│
+  │ 0  1  │  gray diff     │ │ 1  0  │  gray diff     │ alpha diff (mod 256)   │
+  └───────┴────────────────┘ └───────┴────────────────┴────────────────────────┘
+  
+  The gray diff is stored with a bias of 32. OP_RGB (0xFE) is followed by one 
+  byte of gray and OP_RGBA (0xFF) by a byte of gray and a byte of alpha. With raw
+  blocks enabled, the last OP_INDEX (index 63) starts a raw block instead:
+  
+  ┌─ OP_GRAY_RAW ──────────┬────────────────────────┬─────────────────────────┐
+  │         Byte[0]        │         Byte[1]        │  length bytes of gray   │
+  │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │                         │
+  │────────────────────────┼────────────────────────┼─────────────────────────│
+  │ 0  0  1  1  1  1  1  1 │      length - 1        │  ...                    │
+  └────────────────────────┴────────────────────────┴─────────────────────────┘
+  
+  so with raw blocks the longest exact-match cache (30) is unavailable. Gray mode
+  is never used when writing plain QOI files.
+  
+  7. SEEDED SECONDARY CACHES
+  The secondary caches normally start out holding a fixed set of colors. An 
+  indexed PNG, or any image with few colors, does much better when they start 
+  out holding its own colors, so that nearly every pixel is a one or two byte
+  index from the first row on. When seeding is enabled, the header is followed
+  by a seed block:
+  
+  ┌─ SEED ─────────────────┬────────────────────────┬─────────────────────────┐
+  │         Byte[0]        │         Byte[1]        │  colors, 3 or 4 bytes   │
+  │                        │                        │  each (as many as the   │
+  │      seed type (0)     │   number of colors - 1 │  channels byte says)    │
+  └────────────────────────┴────────────────────────┴─────────────────────────┘
+  
+  After both caches are set up as usual, the colors are stored into the exact
+  match cache, each in the first slot at or after its long hash that an earlier
+  seed color did not take. They also go into the near match cache at their local
+  hash, last color first, so the first colors win any collisions there. From 
+  then on the exact match cache is left alone: colors pushed out of the main 
+  cache are no longer saved there, so the seed colors stay indexable for the 
+  whole image. Seeding needs long indexing. It is not entropy coded.
+  
+  Images from a known family (map tiles, screenshots) can instead start from a 
+  shared dictionary, trained on samples of that family by qoigtrain. The seed 
+  block then names the dictionary by the 32 bit ID it was saved with, and the 
+  decoder has to be handed the same dictionary:
+  
+  ┌─ SEED (dictionary) ────┬─────────────────────────────────────────────────┐
+  │         Byte[0]        │                  Bytes[1-4]                     │
+  │      seed type (1)     │        dictionary ID (32 bits, big endian)      │
+  └────────────────────────┴─────────────────────────────────────────────────┘
+  
+  A dictionary file is "qogd", the ID, a list of 64 colors for the main cache
+  (most useful first), and full contents for each of the two secondary caches
+  (256 colors each), all colors stored as 4 bytes RGBA. After the caches are 
+  set up as usual, the main cache list is stored, last color first, at each
+  color's hash in the exact match part and at its local hash in the near match
+  part, and the secondary caches are replaced (if long indexing is on). Unlike
+  with a palette, all caches go on adapting as usual afterwards. Dictionaries
+  are not used in gray mode.
+  
+  The third lowest bit of the colorspace byte is set to enable this feature.
+  
+  8. CHECKSUMS
+  A flipped bit in the byte codes doesn't just spoil one pixel: every pixel 
+  after it is predicted from the wrong caches. For storage that needs to catch 
+  that, the file can end with a trailer of CRC32C checksums. The stream (all 
+  bytes from the header through the footer and any state trailer, or through
+  the end marker with QOIG+) is cut into chunks of 65536 bytes, the last one
+  possibly shorter, and each gets a checksum:
+  
+  ┌─ TRAILER ──────────────┬────────────────────────┬─────────────────────────┐
+  │  CRC32C of each chunk  │   number of chunks     │  CRC32C of the trailer  │
+  │  (32 bits, BE, each)   │   (32 bits, BE)        │  before this (32 bits)  │
+  └────────────────────────┴────────────────────────┴─────────────────────────┘
+  
+  The trailer is found from the end of the file, so a whole file can be checked
+  without decoding it, and a decoder that has the file in memory can check each
+  chunk as it gets to it. Streaming decoders that don't care can ignore it.
+  
+  The fourth lowest bit of the colorspace byte is set to enable this feature.
+  
+  9. ALPHA CHANGES
+  Every byte code but OP_RGBA keeps alpha from the last pixel, so anti-aliased
+  sprite edges and soft shadows, where alpha changes from one pixel to the next,
+  cost 5 bytes a pixel (or 4 in a raw block). With this feature on, two more run
+  codes become byte codes for that:
+  
+  ┌─ OP_ALPHA ─────────────┬────────────────────────┐
+  │         Byte[0]        │         Byte[1]        │
+  │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+  │────────────────────────┼────────────────────────│
+  │ 1  1  1  1  1  1  0  0 │        new alpha       │
+  └────────────────────────┴────────────────────────┘
+  ┌─ OP_ALPHA_DIFF ────────┬────────────────────────┐
+  │         Byte[0]        │         Byte[1]        │
+  │ 7  6  5  4  3  2  1  0 │ 7  6 │ 5  4 │ 3  2 │ 1  0 │
+  │────────────────────────┼──────┼──────┼──────┼──────│
+  │ 1  1  1  1  1  0  1  1 │  dr  │  dg  │  db  │  da  │
+  └────────────────────────┴──────┴──────┴──────┴──────┘
+  
+  OP_ALPHA keeps the color of the last pixel with a new alpha. OP_ALPHA_DIFF is
+  OP_DIFF with an alpha difference too, all four stored with a bias of 2. That 
+  leaves runs of 1 to 59 pixels for the shortest run codes, and the last run code
+  (0xFD) stands for a run of 60 rather than 62, or starts a long run of 60 more
+  than its value. It only applies to RGBA images.
+  
+  The fifth lowest bit of the colorspace byte is set to enable this feature.
+  
+  10. BIG CACHE
+  On photos the main cache is far too small: its exact-match part holds at most
+  64 colors, and a slot is taken over by every new color that hashes to it. A
+  big cache of 2^b colors (b from 7 to 10) takes every color that isn't part of
+  a run, at a Fibonacci hash of the color read as a 32 bit number with red in
+  the low byte:
+  
+      ((r | g<<8 | b<<16 | a<<24) * 0x9E3779B1 mod 2^32) >> (32-b)
+  
+  which spreads well over any power of two. It is reached by a two byte index.
+  The k = max(1, 2^b/256) index codes just below the long index prefixes (or at
+  the top, without long indexing) become prefixes; the one at p from the first
+  gives the high bits of the slot and the next byte the low eight:
+  
+  ┌─ OP_BIG_INDEX ─────────┬────────────────────────┐
+  │         Byte[0]        │         Byte[1]        │
+  │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+  │───────┼────────────────┼────────────────────────│
+  │ 0  0  │   first + p    │  slot (lower 8 bits)   │
+  └───────┴────────────────┴────────────────────────┘
+  
+  The near-match part of the main cache gives up those k slots, and the exact
+  match part can't reach them. The encoder tries the big cache after the main
+  cache and the exact match secondary cache. The big cache starts out all zero
+  and is never seeded. b is stored in a byte after the header and its flag 
+  byte, before any seed block. Gray mode doesn't use it.
+  
+  The sixth lowest bit of the colorspace byte is set to enable this feature.
+  
+  11. STATE TRAILER
+  Images that grow at the bottom (logs, scans, plots of a running process) would
+  otherwise have to be coded over from the top for every few rows added. The
+  encoder can save what it knows after the last pixel in a trailer after the
+  footer, so rows can be appended by picking up from there:
+  
+  ┌─ STATE TRAILER ──────────────────────────────────────────────────────┐
+  │ keep    stream length before the end of stream marker (64 bits, BE)  │
+  │ last    the last pixel, r g b a (4 bytes)                            │
+  │ run     pending run length (32 bits, BE)                             │
+  │ op      OP_RGB or OP_RGBA of a pending raw block, or 0 (1 byte)      │
+  │ n       pixels waiting in the raw block (1 byte)                     │
+  │ carry   near-lossless error carried over, r g b (3 bytes, signed)    │
+  │ probe   how far seeds may sit past their hash (1 byte)               │
+  │ raw     the n waiting pixels (3 or 4 bytes each, 1 in gray mode)     │
+  │ cache   main cache (64 colors, 4 bytes each)                         │
+  │ long    both secondary caches (2x256 colors), with long indexing     │
+  │ big     the big cache (2^b colors), if there is one                  │
+  │ length  bytes of all the above (32 bits, BE)                         │
+  └──────────────────────────────────────────────────────────────────────┘
+  
+  Colors are stored in the byte order of the pixels. To append, an encoder is
+  set up from the trailer, the stream is cut at keep, which drops the end marker
+  flushing the pending run and raw block along with the footer, and the new rows
+  are coded on from there, ending with a new footer and state trailer. The
+  height in the header is updated in place. The result is the same file as
+  coding all the rows at once. The trailer is part of the stream as far as the 
+  checksums go. Decoders stop at the footer and never need it. Not available
+  with QOIG+, whose last block would have to be coded over again.
+  
+  The seventh lowest bit of the colorspace byte is set to enable this feature.
+  
+  12. COLOR TRANSFORM
+  Where a color changes in more than brightness, OP_LUMA runs out of range
+  and the pixel is coded as an OP_RGB. The encoder can instead code every color
+  through the lossless YCoCg-R transform, done in 8 bit arithmetic that wraps
+  around (>> is an arithmetic shift of the byte as a signed number):
+  
+      co = r - b          t = y - (cg >> 1)
+      t  = b + (co >> 1)  g = cg + t
+      cg = g - t          b = t - (co >> 1)
+      y  = t + (cg >> 1)  r = b + co
+  
+  and stores co, y, cg in place of r, g, b; alpha is left alone. Every code
+  then works on transformed colors as if they were ordinary ones: diffs and
+  lumas are taken between them, and caches, seeds and dictionaries hold them 
+  (seed colors are stored untransformed in the header, and both sides
+  transform them). The decoder puts each color it decodes back through the
+  inverse before it goes in the row.
+  
+  Whether it helps depends on the image: it does on many drawings and screen
+  images, while on photos OP_LUMA, which already takes green out of red and
+  blue, usually does better without it. Not used in gray mode or with
+  near-lossless encoding, whose error bounds are on r, g and b.
+  
+  The lowest bit of the flag byte after the header is set to enable this
+  feature.
   */
 #include <string.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 //Uses libspng with miniz
 #define SPNG_STATIC
@@ -124,6 +386,33 @@
 #include "spng.h"
 
 #define QOIG_SRBG 0
+//Header extension flags kept in the colorspace byte
+#define QOIG_COLORSPACE 0x01
+#define QOIG_EXT_ENTROPY 0x02
+#define QOIG_EXT_SEED 0x04
+#define QOIG_EXT_CRC 0x08
+#define QOIG_EXT_ALPHA 0x10
+#define QOIG_EXT_BIGCACHE 0x20
+#define QOIG_EXT_STATE 0x40
+#define QOIG_EXT_MORE 0x80
+#define QOIG_EXT_KNOWN (QOIG_COLORSPACE|QOIG_EXT_ENTROPY|QOIG_EXT_SEED|QOIG_EXT_CRC|QOIG_EXT_ALPHA|QOIG_EXT_BIGCACHE|\
+                        QOIG_EXT_STATE|QOIG_EXT_MORE)
+//More header extension flags, in the byte after the header
+#define QOIG_EXT2_XFORM 0x01
+#define QOIG_EXT2_MORE 0x80
+#define QOIG_EXT2_KNOWN (QOIG_EXT2_XFORM)
+//Seed block types
+#define QOIG_SEED_PALETTE 0
+#define QOIG_SEED_DICT 1
+//Size of a dictionary file
+#define QOIG_DICT_SIZE (8+4*(64+256+256))
+//Bins in the color histogram used to pick seed colors
+#define QOIG_HIST 4096
+//Size of an entropy coded block and the longest code allowed in one
+#define QOIG_BLOCK 32768
+#define QOIG_MAXBITS 12
+//Bytes covered by each checksum in the trailer
+#define QOIG_CRC_CHUNK 65536
 #define QOIG_CACHES {0,1,2,4,8,\
                      11,13,16,17,19,\
                      22,23,26,29,31,\
@@ -135,6 +424,8 @@
 #define OP_RGB (uint8_t)0xFE
 #define OP_RGBA (uint8_t)0xFF
 #define OP_RGBRUN (uint8_t)0x6A
+#define OP_ALPHA (uint8_t)0xFC
+#define OP_ALPHADIFF (uint8_t)0xFB
 #define OP_INDEX (uint8_t)0
 #define OP_DIFF (uint8_t)0x40
 #define OP_LUMA (uint8_t)0x80
@@ -146,6 +437,12 @@
 #define HASH(C,H) ((C.red*3+C.green*5+C.blue*7+C.alpha*11)%H)
 #define LHASH(C) ((23*C.red+29*C.green+59*C.blue+197*C.alpha)&0xFF)
 #define LRS(a,b) ((unsigned)(a)>>b)
+//Fibonacci hash into a big cache of 2^B colors, the same on either byte order
+#define BIGHASH(C,B) (((uint32_t)C.red|C.green<<8|C.blue<<16|(uint32_t)C.alpha<<24)*0x9E3779B1u>>(32-(B)))
+//Index codes taken by big cache prefixes, and the end of the near match part 
+//of the main cache below them and the long index prefixes
+#define QOIG_BIGSLOTS(cfg) ((cfg).bigcache ? ((1<<(cfg).bigcache)+255)/256 : 0)
+#define QOIG_NEAREND(cfg) (64-2*(cfg).longindex-QOIG_BIGSLOTS(cfg))
 #define LOCALHASH(C,H,L) (H+(LRS(C.red+8,3)*37+LRS(C.green+8,3)*59+\
                      LRS(C.blue+8,3)*67)%(L-H))
 #define TUBITRANGE(a,b) ((char)(a-b)>-3 && (char)(a-b)<2)
@@ -153,25 +450,69 @@
                          TUBITRANGE(a.green,b.green) && \
                          TUBITRANGE(a.blue,b.blue)
 #define EQCOLOR(a,b) (a.rgba == b.rgba)
+#define NEARCOLOR(a,b,T) (a.alpha == b.alpha && abs(a.red-b.red) <= (T) &&\
+                          abs(a.green-b.green) <= (T) && abs(a.blue-b.blue) <= (T))
 #define QOIG_PRINT(b) if (bufferedrgb && !rgbrun) {\
-                          if (!cfg.simulate) {\
-                              fprintf(outfile,"%c",bufferedrgb);\
-                              fwrite(&last,1,3+(bufferedrgb&1),outfile);\
-                          }\
-                          ct+=4+(bufferedrgb&1);\
+                          *o++ = bufferedrgb;\
+                          memcpy(o,&last,3+(bufferedrgb&1));\
+                          o += 3+(bufferedrgb&1);\
                           bufferedrgb = 0;\
                       } else if (rgbrun) {\
-                          if (!cfg.simulate) {\
-                              fprintf(outfile,"%c%c",OP_RGBRUN,rgbrun-2|(bufferedrgb&1)<<7);\
-                              fwrite(rgbbuffer,1,rgbrun*(bufferedrgb-0xFB),outfile);\
-                          }\
-                          ct+=2+rgbrun*(bufferedrgb-0xFB);\
+                          *o++ = OP_RGBRUN;\
+                          *o++ = rgbrun-2|(bufferedrgb&1)<<7;\
+                          memcpy(o,rgbbuffer,rgbrun*(bufferedrgb-0xFB));\
+                          o += rgbrun*(bufferedrgb-0xFB);\
                           rgbrun=0;\
                           bufferedrgb=0;\
                       }\
-                      if (!cfg.simulate) fprintf(outfile,"%c",b);\
-                      ct++
-#define QOIG_READ(a,b,c,d) if (fread(a,b,c,d)!=c) return -1
+                      *o++ = (b)
+//Gray mode counterpart of QOIG_PRINT. Gray literals queue up in rgbbuffer.
+#define QOIG_GPRINT(b) if (rgbrun == 1) {\
+                           *o++ = OP_RGB;\
+                           *o++ = rgbbuffer[0];\
+                       } else if (rgbrun) {\
+                           *o++ = OP_INDEX|63;\
+                           *o++ = rgbrun-1;\
+                           memcpy(o,rgbbuffer,rgbrun);\
+                           o += rgbrun;\
+                       }\
+                       rgbrun = 0;\
+                       *o++ = (b)
+//Run that the last run code stands for. Alpha changes take the two below it.
+#define QOIG_MAXRUN (62-2*cfg.alpha)
+#define QOIG_RUN(PRINT) if (run <= QOIG_MAXRUN - cfg.longruns) {\
+                            PRINT(OP_RUN|(run == QOIG_MAXRUN ? 61 : run-1));\
+                        } else {\
+                            PRINT(OP_RUN|61);\
+                            run-=QOIG_MAXRUN;\
+                            if (run < 128) {\
+                                PRINT(run);\
+                            } else {\
+                                run-=128;\
+                                PRINT(0x80|LRS(run,8));\
+                                PRINT(0xFF&run);\
+                            }\
+                        }\
+                        run = 0
+//The pixel before the first. Gray pixels keep gray and alpha in the first two bytes.
+#define QOIG_FIRST(ch) ((ch)<3 ? (color){.green=255} : (color){.alpha=255})
+#define QOIG_READ(a,c) if (pos+(c)>inlen) goto more; else memcpy(a,in+pos,c), pos+=(c)
+//Worst case output of one call to qoig_encoder_push besides 6 bytes per pixel:
+//a pending run plus a full raw block
+#define QOIG_SLACK 1100
+//Called by the decoder after each codeword, for tools such as qoigdump to
+//define before including this file. code points at the codeword's len bytes
+//(byte codes, after any entropy decoding), i is the offset of its pixel in
+//the row, inraw is set for a pixel partway through a raw block, and run is
+//the number of further pixels it repeats for.
+#ifndef QOIG_TRACE
+#define QOIG_TRACE(d,i,code,len,inraw,run)
+#endif
+//Return codes of qoig_decoder_push
+#define QOIG_MORE 0
+#define QOIG_HEADER 1
+#define QOIG_ROW 2
+#define QOIG_DONE 3
 
 typedef union {
     uint32_t rgba;
@@ -190,6 +531,32 @@ typedef struct {
 	uint8_t colorspace;
 } qoig_desc;
 
+//Colors to preload the secondary caches with, most important first
+typedef struct {
+    uint16_t n;
+    color colors[256];
+} qoig_seed;
+
+//Shared starting contents for the caches, see qoigtrain
+typedef struct {
+    uint32_t id;
+    color cache[64];
+    color longcache1[256];
+    color longcache2[256];
+} qoig_dict;
+
+//Part of an image to convert: the rectangle at x,y of width by height pixels
+//(0 for the rest of the image), shrunk by averaging boxes of scale by scale
+//pixels (up to 16; 0 or 1 keeps full size). Boxes at the right and bottom 
+//edges may be cut short.
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint8_t scale;
+} qoig_view;
+
 typedef struct {
     unsigned int bytecap;
     unsigned char longruns;
@@ -199,7 +566,97 @@ typedef struct {
     unsigned char channels;
     unsigned char longindex;
     unsigned char rawblocks;
+    unsigned char entropy;
+    unsigned char gray;
+    unsigned char crc;
+    unsigned char tolerance;
+    unsigned char alpha;
+    unsigned char bigcache;
+    unsigned char state;
+    unsigned char xform;
+    const qoig_seed *seed;
+    const qoig_dict *dict;
+    qoig_view view;
 } qoig_cfg;
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    uint8_t mapped;
+} qoig_buf;
+
+/*Codec state. All cache, run, and raw block state lives here rather than on 
+  the stack of a blocking loop, so encoding and decoding can be suspended
+  after any pixel and resumed later. The encoder takes pixels in any 
+  amounts and leaves output in out for the caller to collect. The decoder
+  takes input bytes in any amounts and hands back one row at a time.*/
+typedef struct {
+    qoig_cfg cfg;
+    qoig_desc desc;
+    int clen;
+    color cache[64];
+    color longcache1[256];
+    color longcache2[256];
+    color bigcache[1024];
+    color current;
+    uint32_t run;
+    uint8_t bufferedrgb;
+    uint8_t rgbrun;
+    uint8_t rgbbuffer[516];
+    uint8_t *out;
+    size_t outlen;
+    size_t outcap;
+    uint8_t *ent;
+    size_t entlen;
+    size_t entcap;
+    int lprobe;
+    uint8_t frozen;
+    unsigned long ct;
+    uint8_t finished;
+    int carry[3];
+    uint32_t crc;
+    size_t crcpos;
+    uint8_t *crcs;
+    size_t crclen;
+    size_t crccap;
+} qoig_encoder;
+
+typedef struct {
+    qoig_cfg cfg;
+    qoig_desc desc;
+    int clen;
+    color cache[64];
+    color longcache1[256];
+    color longcache2[256];
+    color bigcache[1024];
+    color current;
+    uint32_t run;
+    uint8_t cbyte;
+    uint8_t rgbrun;
+    uint8_t *row;
+    size_t rowlen;
+    size_t rowcap;
+    size_t x;
+    uint32_t y;
+    uint8_t state;
+    uint8_t npending;
+    uint8_t pending[16];
+    uint8_t *blk;
+    size_t blkhave;
+    size_t blkneed;
+    uint8_t *plain;
+    size_t plainlen;
+    size_t plainpos;
+    uint8_t ext[2+1024];
+    size_t exthave;
+    size_t extneed;
+    uint8_t frozen;
+    const qoig_dict *dict;
+    const uint8_t *crcs;
+    size_t streamlen;
+    size_t checked;
+    uint32_t crc;
+} qoig_decoder;
 static color default_colors_be[256] = {
 0x0000ffff,0xffcc33ff,0x003300ff,0x66cc66ff,0x993399ff,0xffccffff,0x0033ccff,0xffff00ff,
 0x838383ff,0x66ff33ff,0x996666ff,0xffffccff,0x006699ff,0x66ffffff,0xddddddff,0x6c6c6cff,
@@ -334,30 +791,32 @@ static color default_colors2_le[256] = {
 0xff33cc00,0xff336600,0xffbebebe,0xffc9c9c9,0xff99cccc,0xff9966cc,0xffffccff,0xffff66ff};
 
 
-int qoig_encode(spng_ctx *ctx, size_t width, FILE *outfile, unsigned long *outlen, qoig_cfg cfg) {
-    color cache[64] = {0};
-    color longcache1[256];
-    color longcache2[256];
-    color row[width];
-    uint8_t rgbbuffer[516];
-    color last;
-    color current = (color){.alpha=255};
-    color temp,temp2;
-    int i,j;
-    char k,l;
-    uint8_t m;
-    uint8_t lastrow = 0;
-    uint8_t ret,done;
-    uint8_t bufferedrgb = 0;
-    uint8_t rgbrun = 0;
-    uint32_t run = 0;
-    unsigned long ct = 0;
-    int rows_read = 0;
-    uint8_t colorhash,lcolorhash;
-    int cachelengths[31] = QOIG_CACHES;
-    int clen;
+//The color transform of section 12 (YCoCg-R) and its inverse
+static inline color qoig_xform(color c) {
+    uint8_t co = c.red-c.blue;
+    uint8_t t = c.blue+((int8_t)co>>1);
+    uint8_t cg = c.green-t;
+    
+    c.red = co;
+    c.green = t+((int8_t)cg>>1);
+    c.blue = cg;
+    return c;
+}
+
+static inline color qoig_unxform(color c) {
+    uint8_t t = c.green-((int8_t)c.blue>>1);
+    uint8_t b = t-((int8_t)c.red>>1);
+    
+    c.green = c.blue+t;
+    c.red += b;
+    c.blue = b;
+    return c;
+}
+
+static void qoig_init_caches(color *cache, color *longcache1, color *longcache2, int clen, qoig_cfg cfg) {
+    color current = QOIG_FIRST(cfg.channels);
     
-    clen = cachelengths[cfg.clen];
+    memset(cache,0,64*sizeof(color));
     if (cfg.longindex) {
         if (IS_BIG_ENDIAN) {
 			memcpy(longcache1,default_colors_be,256*sizeof(color));
@@ -371,424 +830,2475 @@ int qoig_encode(spng_ctx *ctx, size_t width, FILE *outfile, unsigned long *outle
         cache[HASH(current,clen)] = current;
         if (cfg.longindex) longcache1[LHASH(current)] = current;
     }
-    /*spng_decode_row is a bad API. a sane API would return 0 after every successful read*/
-    while (!(ret = spng_decode_row(ctx, row, 4*width)) || lastrow && ret == SPNG_EOI || run) {
-        done = ret == SPNG_EOI && !lastrow;
-        lastrow = !ret;
-        for (i=0;i<width&&(!cfg.bytecap||i+width*rows_read<cfg.bytecap);i+=1) {
-            
-            last = current;
-            
-            //Get next pixel
-
-            current=row[i];
-
-            //Try to make run
-            if (!done && EQCOLOR(current,last) && (run<62 || cfg.longruns && run < 32957)) {
-                run++;
-                continue;
-            }
-            if (run) {
-                if (run <= 62 - cfg.longruns) {
-                    QOIG_PRINT(OP_RUN|(run-1));
-                } else {
-                    QOIG_PRINT(OP_RUN|61);
-                    run-=62;
-                    if (run < 128) {
-                        QOIG_PRINT(run);
-                    } else {
-                        run-=128;
-                        QOIG_PRINT(0x80|LRS(run,8));
-                        QOIG_PRINT(0xFF&run);
-                    }
-                }
-                run = 0;
-                if (done) break;
-                if (EQCOLOR(current,last)) {
-                    run++;
-                    continue;
-                }
-            }
-            
-            
-
-            if (clen) {
-                //Try to make exact index into cache
-                colorhash = HASH(current,clen);
-                temp = cache[colorhash];
-                if (EQCOLOR(current,temp)) {
-                    QOIG_PRINT(OP_INDEX|colorhash&OP_INDEX_ARG);
-                    continue;
-                }
-
-                cache[colorhash] = current;
-                if (cfg.longindex) {
-                    lcolorhash = LHASH(current);
-                    temp2 = longcache1[lcolorhash];
-                    longcache1[LHASH(temp)] = temp;
-                    if (EQCOLOR(current,temp2)) {
-                        QOIG_PRINT(OP_INDEX|62&OP_INDEX_ARG);
-                        QOIG_PRINT(lcolorhash);
-                        continue;
-                    }
-                }
-            }
-            
-            //Try to make exact diff with previous pixel
-            if (COLORRANGES(current,last) &&
-                current.alpha == last.alpha) {
-                QOIG_PRINT(OP_DIFF|(current.red-last.red+2&3)<<4|
-                                    (current.green-last.green+2&3)<<2|
-                                        (current.blue-last.blue+2&3));
-                continue;
-            }
-
+}
 
-            //Try to make luma diff with previous pixel
-            j = current.green-last.green;
-            if (j>-33 && j<32 && current.alpha == last.alpha) {
-                k = current.red-last.red-j;
-                l = current.blue-last.blue-j;
-                if (-9<k && -9<l && k<8 && l<8) {
-                    QOIG_PRINT(OP_LUMA|(j+32&OP_LUMA_ARG));
-                    QOIG_PRINT((k+8&15)<<4|l+8&15);
-                    continue;
-                }
-            }
-            if (64-clen-2*cfg.longindex) {
-                //Try to make diff index into cache
-                colorhash=m=LOCALHASH(current,clen,64-2*cfg.longindex);
-                temp = cache[m];
-                if (COLORRANGES(current,temp) &&
-                    current.alpha == temp.alpha) {
-                    smalldiff:QOIG_PRINT(OP_INDEX|m&OP_INDEX_ARG);
-                    QOIG_PRINT(OP_DIFF|(current.red-temp.red+2&3)<<4|
-                                            (current.green-temp.green+2&3)<<2|
-                                            (current.blue-temp.blue+2&3));
-                    continue;
-                }
-                
-                //Next just search the entire cache for the nearest color
-                if (cfg.searchcache) {
-                    for (j=clen;j<64-2*cfg.longindex;j++) {
-                        temp2 = cache[j];
-                        if (COLORRANGES(current,temp2) && current.alpha == temp2.alpha) {
-                            temp = temp2;
-                            m=j;
-                            goto smalldiff;
-                        }
-                        k = current.green - temp2.green;
-                        if (k>-33 && k<32) {
-                            k = current.red-temp.red-j;
-                            l = current.blue-temp.blue-j;
-                            if (-9<k && -9<l && k<8 && l<8) {
-                                temp = temp2;
-                                m = j;
-                            }
-                        }
-                    }
-                }
+//Preload seed colors into the secondary caches. Each seed takes the first slot
+//of the exact match cache at or after its long hash that no earlier seed took.
+//Returns the furthest any seed had to move.
+static int qoig_seed_caches(color *longcache1, color *longcache2, const qoig_seed *seed, int xform) {
+    uint8_t taken[256] = {0};
+    color c;
+    int i,k,probe = 0;
+    uint8_t h;
+    
+    for (i=0;i<seed->n;i++) {
+        c = seed->colors[i];
+        if (xform) c = qoig_xform(c);
+        for (h=LHASH(c),k=0;taken[h];h++,k++);
+        taken[h] = 1;
+        longcache1[h] = c;
+        if (k>probe) probe = k;
+    }
+    for (i=seed->n-1;i>=0;i--) {
+        c = seed->colors[i];
+        if (xform) c = qoig_xform(c);
+        longcache2[LOCALHASH(c,0,256)] = c;
+    }
+    return probe;
+}
 
-                //Try to make luma index into cache
-                j = current.green-temp.green;
-                if (j>-33 && j<32 && current.alpha == temp.alpha) {
-                    k = current.red-temp.red-j;
-                    l = current.blue-temp.blue-j;
-                    if (-9<k && -9<l && k<8 && l<8) {
-                        QOIG_PRINT(OP_INDEX|m&OP_INDEX_ARG);
-                        QOIG_PRINT(OP_LUMA|j+32&0x3F);
-                        QOIG_PRINT((k+8&15)<<4|l+8&15);
-                        continue;
-                    }
-                }
-                //if we are buffering an RGB block, interrupting that to insert an long-indexed diff can cost an extra byte
-                if (cfg.longindex && !(rgbrun && bufferedrgb==OP_RGB && current.alpha==last.alpha)) {
-                    //Try to make diff index into cache
-                    m=LOCALHASH(current,0,256);
-                    temp = longcache2[m];
-                    if (COLORRANGES(current,temp) &&
-                        current.alpha == temp.alpha) {
-                        lsmalldiff:QOIG_PRINT(OP_INDEX|63&OP_INDEX_ARG);
-                        QOIG_PRINT(m);
-                        QOIG_PRINT(OP_DIFF|(current.red-temp.red+2&3)<<4|
-                                                (current.green-temp.green+2&3)<<2|
-                                                (current.blue-temp.blue+2&3));
-                        continue;
-                    }
-                    
-                    //Next just search the entire cache for the nearest color
-                    if (cfg.searchcache) {
-                        for (j=0;j<256;j++) {
-                            temp2 = longcache2[j];
-                            if (COLORRANGES(current,temp2) && current.alpha == temp2.alpha) {
-                                temp = temp2;
-                                m=j;
-                                goto lsmalldiff;
-                            }
-                            if (current.alpha != last.alpha) {
-                                k = current.green - temp2.green;
-                                if (k>-33 && k<32) {
-                                    k = current.red-temp.red-j;
-                                    l = current.blue-temp.blue-j;
-                                    if (-9<k && -9<l && k<8 && l<8) {
-                                        temp = temp2;
-                                        m = j;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    
-                    //Try to make luma index into cache
-                    //There are no savings here if current alpha matches previous,
-                    //and it's faster to just use an OP_RGB
-                    //Likewise, interrupting an rgbrun for a long-indexed luma can cost an extra byte
-                    if (current.alpha != last.alpha && !rgbrun) {
-                        j = current.green-temp.green;
-                        if (j>-33 && j<32 && current.alpha == temp.alpha) {
-                            k = current.red-temp.red-j;
-                            l = current.blue-temp.blue-j;
-                            if (-9<k && -9<l && k<8 && l<8) {
-                                QOIG_PRINT(OP_INDEX|63&OP_INDEX_ARG);
-                                QOIG_PRINT(m);
-                                QOIG_PRINT(OP_LUMA|j+32&0x3F);
-                                QOIG_PRINT((k+8&15)<<4|l+8&15);
-                                continue;
-                            }
-                        }
-                    }
-                }
-            }
+//Start the caches from a dictionary instead of the built in colors.
+//Transformed colors hash elsewhere, so each is put back at its own hash.
+static void qoig_dict_caches(color *cache, color *longcache1, color *longcache2, int clen, qoig_cfg cfg, const qoig_dict *dict) {
+    color c;
+    int i;
+    
+    for (i=63;i>=0;i--) {
+        c = dict->cache[i];
+        if (cfg.xform) c = qoig_xform(c);
+        if (clen) cache[HASH(c,clen)] = c;
+        if (QOIG_NEAREND(cfg)-clen) cache[LOCALHASH(c,clen,QOIG_NEAREND(cfg))] = c;
+    }
+    if (cfg.longindex && cfg.xform) {
+        for (i=255;i>=0;i--) {
+            c = qoig_xform(dict->longcache1[i]);
+            longcache1[LHASH(c)] = c;
+            c = qoig_xform(dict->longcache2[i]);
+            longcache2[LOCALHASH(c,0,256)] = c;
+        }
+    } else if (cfg.longindex) {
+        memcpy(longcache1,dict->longcache1,256*sizeof(color));
+        memcpy(longcache2,dict->longcache2,256*sizeof(color));
+    }
+}
 
-            //Try to make RGB or RGBA pixel
-            //If we're buffering a pixel write, switch to raw mode and write it
-            if (cfg.rawblocks) {
-                if (rgbrun==129 || rgbrun && (bufferedrgb == OP_RGB && current.alpha!=last.alpha ||
-                    bufferedrgb == OP_RGBA && current.alpha==last.alpha)) {
-                    if (!cfg.simulate) {
-                        fprintf(outfile,"%c%c",OP_RGBRUN,rgbrun-2|(bufferedrgb&1)<<7);
-                        fwrite(rgbbuffer,1,rgbrun*(bufferedrgb-0xFB),outfile);
-                    }
-                    ct+=rgbrun*(bufferedrgb-0xFB);
-                    rgbrun=0;
-                    bufferedrgb = 0;
-                }
-                if (bufferedrgb||rgbrun) {
-                    if (bufferedrgb == OP_RGB && current.alpha!=last.alpha) {
-                        bufferedrgb = 0;
-                        QOIG_PRINT(OP_RGB);
-                        if (!cfg.simulate) {
-                            fwrite(&last,1,3,outfile);
-                        }
-                        ct+=3;
-                        bufferedrgb = OP_RGBA;
-                    } else {
-                        if (!rgbrun) {
-                            memcpy(rgbbuffer,&last,3+(bufferedrgb&1));
-                            rgbrun=1;
-                        }
-                        memcpy(rgbbuffer+(3+(bufferedrgb&1))*rgbrun,&current,3+(bufferedrgb&1));
-                        rgbrun++;
-                    }
-                } else {
-                    if (current.alpha == last.alpha) {
-                        bufferedrgb = OP_RGB;
-                    } else {
-                        bufferedrgb = OP_RGBA;
-                    }
-                }
-            } else {
-                if (current.alpha == last.alpha) {
-                    QOIG_PRINT(OP_RGB);
-                    j=3;
-                } else {
-                    QOIG_PRINT(OP_RGBA);
-                    j=4;
-                }
-                if (!cfg.simulate) {
-                    fwrite(&current,1,j,outfile);
-                }
-                ct+=j;
-            }
-            if (64-clen-2*cfg.longindex) {
-                if (cfg.longindex) {
-                    temp = cache[colorhash];
-                    if (!EQCOLOR(temp,current)) {
-                        longcache2[LOCALHASH(temp,0,256)] = temp;
-                    }
-                }
-                cache[colorhash] = current;
+//Build code lengths of at most QOIG_MAXBITS for the byte frequencies in freq
+static void qoig_huff_lengths(const uint32_t *freq, uint8_t *len) {
+    uint32_t f[256];
+    uint32_t w[511];
+    uint16_t parent[511];
+    uint8_t depth[511];
+    uint8_t sym[256];
+    int n,i,j,a,leaf,node,maxlen;
+    
+    memcpy(f,freq,sizeof(f));
+    do {
+        memset(len,0,256);
+        n = 0;
+        for (i=0;i<256;i++) {
+            if (f[i]) sym[n++] = i;
+        }
+        if (n < 2) {
+            if (n) len[sym[0]] = 1;
+            return;
+        }
+        //Sort symbols by frequency
+        for (i=1;i<n;i++) {
+            a = sym[i];
+            for (j=i;j>0 && f[sym[j-1]]>f[a];j--) sym[j] = sym[j-1];
+            sym[j] = a;
+        }
+        for (i=0;i<n;i++) w[i] = f[sym[i]];
+        //Merge the two lightest of the sorted leaves and the internal nodes,
+        //which come out in sorted order on their own
+        leaf = 0;
+        node = n;
+        for (i=n;i<2*n-1;i++) {
+            w[i] = 0;
+            for (j=0;j<2;j++) {
+                a = leaf<n && (node>=i || w[leaf]<=w[node]) ? leaf++ : node++;
+                parent[a] = i;
+                w[i] += w[a];
             }
         }
-        if (cfg.bytecap && 4*i + rows_read*width > cfg.bytecap) break;
-        rows_read++;
+        depth[2*n-2] = 0;
+        maxlen = 0;
+        for (i=2*n-3;i>=0;i--) depth[i] = depth[parent[i]]+1;
+        for (i=0;i<n;i++) {
+            len[sym[i]] = depth[i];
+            if (depth[i]>maxlen) maxlen = depth[i];
+        }
+        //Too deep for the decoding table, so flatten the statistics and try again
+        for (i=0;i<256;i++) {
+            if (f[i]) f[i] = f[i]>>1|1;
+        }
+    } while (maxlen > QOIG_MAXBITS);
+}
+
+//Assign canonical codes, bit reversed so they can be sent least significant bit first.
+//Fails if the lengths oversubscribe the code space.
+static int qoig_huff_codes(const uint8_t *len, uint16_t *code) {
+    int count[QOIG_MAXBITS+1] = {0};
+    int next[QOIG_MAXBITS+1];
+    int i,j,c,kraft = 0;
+    
+    for (i=0;i<256;i++) {
+        if (len[i]>QOIG_MAXBITS) return -1;
+        count[len[i]]++;
+    }
+    count[0] = 0;
+    c = 0;
+    for (i=1;i<=QOIG_MAXBITS;i++) {
+        c = c+count[i-1]<<1;
+        next[i] = c;
+        kraft += count[i]<<(QOIG_MAXBITS-i);
+    }
+    if (kraft > 1<<QOIG_MAXBITS) return -1;
+    for (i=0;i<256;i++) {
+        if (!len[i]) continue;
+        c = next[len[i]]++;
+        code[i] = 0;
+        for (j=0;j<len[i];j++) code[i] = code[i]<<1|(c>>j&1);
     }
-    //Flush all buffers
-    QOIG_PRINT(0);
-    *outlen = ct;
     return 0;
 }
 
-int qoig_decode(FILE *infile, size_t width, spng_ctx *ctx, size_t *outlen, qoig_cfg cfg) {
-    color cache[64] = {0};
-    color longcache1[256];
-    color longcache2[256];
-    color current = (color){.alpha=255};
-    color temp;
-    uint8_t cbyte = 0;
-    uint8_t rgbrun = 0;
-    unsigned int i=0;
-    char j;
-    uint8_t m;
-    uint32_t run=0;
-    uint8_t row[width*cfg.channels];
-    unsigned int rows_read = 0;
-    int ret;
-    int cachelengths[31] = QOIG_CACHES;
-    int clen;
+//Write one block of byte codes, Huffman coded unless storing it is smaller.
+//Needs room for 133+n bytes. Returns the number of bytes written.
+static size_t qoig_huff_block(const uint8_t *in, size_t n, uint8_t *out) {
+    uint32_t freq[256] = {0};
+    uint8_t len[256];
+    uint16_t code[256];
+    uint64_t bits = 0;
+    size_t i, size = 0;
+    int nbits = 0;
+    uint8_t *o = out+133;
     
-    clen = cachelengths[cfg.clen];
-    *outlen = 0;
-    if (cfg.longindex) {
-        if (IS_BIG_ENDIAN) {
-			memcpy(longcache1,default_colors_be,256*sizeof(color));
-            memcpy(longcache2,default_colors2_be,256*sizeof(color));
-        } else {
-			memcpy(longcache1,default_colors_le,256*sizeof(color));
-            memcpy(longcache2,default_colors2_le,256*sizeof(color));
+    out[0] = n>>8;
+    out[1] = n;
+    for (i=0;i<n;i++) freq[in[i]]++;
+    qoig_huff_lengths(freq,len);
+    for (i=0;i<256;i++) size += freq[i]*len[i];
+    size = size+7>>3;
+    if (130+size >= n) {
+        out[2] = 0;
+        memcpy(out+3,in,n);
+        return 3+n;
+    }
+    qoig_huff_codes(len,code);
+    out[2] = 1;
+    for (i=0;i<128;i++) out[3+i] = len[2*i]<<4|len[2*i+1];
+    out[131] = size>>8;
+    out[132] = size;
+    for (i=0;i<n;i++) {
+        bits |= (uint64_t)code[in[i]]<<nbits;
+        nbits += len[in[i]];
+        while (nbits>=8) {
+            *o++ = bits;
+            bits >>= 8;
+            nbits -= 8;
         }
     }
-    if (clen) {
-        cache[HASH(current,clen)] = current;
-        if (cfg.longindex) longcache1[LHASH(current)] = current;
+    if (nbits) *o++ = bits;
+    return 133+size;
+}
+
+//Unpack the bitstream of a Huffman coded block into n bytes
+static int qoig_huff_decode(const uint8_t *lens, const uint8_t *in, size_t inlen, uint8_t *out, size_t n) {
+    uint16_t table[1<<QOIG_MAXBITS] = {0};
+    uint8_t len[256];
+    uint16_t code[256];
+    uint64_t bits = 0;
+    size_t i, j, pos = 0;
+    int nbits = 0;
+    uint16_t t;
+    
+    for (i=0;i<128;i++) {
+        len[2*i] = lens[i]>>4;
+        len[2*i+1] = lens[i]&15;
     }
-    do { 
-        for (i=0;i<cfg.channels*width;i+=cfg.channels) {
-            j=0;
-            //Add another pixel for current run
-            if (run) {
-                memcpy(row+i,&current,cfg.channels);
-                *outlen += cfg.channels;
-                run--;
-                continue;
-            }
-            
-            //Fetch next byte
-            if (rgbrun) {
-                rgbrun--;
-            } else {
-                QOIG_READ(&cbyte,1,1,infile);
+    if (qoig_huff_codes(len,code)) return -1;
+    //Every index whose low bits are a code maps to its symbol and length.
+    //Entries left zero belong to no code.
+    for (i=0;i<256;i++) {
+        if (!len[i]) continue;
+        for (j=code[i];j<1<<QOIG_MAXBITS;j+=1<<len[i]) table[j] = i|len[i]<<8;
+    }
+    for (i=0;i<n;i++) {
+        if (nbits < QOIG_MAXBITS) {
+            while (nbits<=56 && pos<inlen) {
+                bits |= (uint64_t)in[pos++]<<nbits;
+                nbits += 8;
             }
+        }
+        t = table[bits&(1<<QOIG_MAXBITS)-1];
+        if (!t || t>>8 > nbits) return -1;
+        out[i] = t;
+        bits >>= t>>8;
+        nbits -= t>>8;
+    }
+    return 0;
+}
 
-            //Decode next codeword
-            switch (cbyte&OP_CODE) {
+//Make sure buf can hold size bytes
+static int qoig_grow(uint8_t **buf, size_t *cap, size_t size) {
+    uint8_t *p;
+    
+    if (size <= *cap) return 0;
+    p = realloc(*buf,size);
+    if (!p) return -1;
+    *buf = p;
+    *cap = size;
+    return 0;
+}
 
-                case OP_INDEX:
-                    j = cbyte&OP_INDEX_ARG;
-                    if (cfg.longindex && j>61) {
-                        QOIG_READ(&cbyte,1,1,infile);
-                        if (j==62) {
-                            current = longcache1[cbyte];
-                            break;
-                        } else {
-                            current = longcache2[cbyte];
-                        }
-                        
-                    } else {
-                        current = cache[j];
-                        if (j<clen) break;
-                    }
-                    QOIG_READ(&cbyte,1,1,infile);
+//CRC32C (Castagnoli) tables for machines without an instruction for it,
+//used 8 bytes at a time (slicing by 8)
+static uint32_t qoig_crc_table[8][256];
 
-                case OP_LUMA:
-                    if ((cbyte&OP_CODE) == OP_LUMA) {
-                        j = (cbyte&OP_LUMA_ARG)-32;
-                        QOIG_READ(&cbyte,1,1,infile);
-                        current.green += j;
-                        current.red += j+(LRS(cbyte,4)&0xF)-8;
-                        current.blue += j+(cbyte&0xF)-8;
-                        break;
-                    }
-                case OP_DIFF:
-                    if (cfg.rawblocks && !j && cbyte == OP_RGBRUN) {
-                        QOIG_READ(&rgbrun,1,1,infile);
-                        cbyte = OP_RGB + LRS(rgbrun,7);
-                        rgbrun = (rgbrun&0x7F)+1;
-                    } else {
-                        current.red += (LRS(cbyte,4)&3)-2;
-                        current.green += (LRS(cbyte,2)&3)-2;
-                        current.blue += (cbyte&3)-2;
-                        break;
-                    }
+__attribute__((constructor)) static void qoig_crc_init() {
+    uint32_t c;
+    int i, j;
+    
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    for (i=0;i<256;i++) {
+        c = i;
+        for (j=0;j<8;j++) c = c>>1^(0x82F63B78&-(c&1));
+        qoig_crc_table[0][i] = c;
+    }
+    for (j=1;j<8;j++) {
+        for (i=0;i<256;i++) {
+            c = qoig_crc_table[j-1][i];
+            qoig_crc_table[j][i] = c>>8^qoig_crc_table[0][c&0xFF];
+        }
+    }
+}
 
+static uint32_t qoig_crc32c_sw(uint32_t c, const uint8_t *p, size_t n) {
+    uint32_t (*t)[256] = qoig_crc_table;
+    uint32_t lo, hi;
+    
+    if (!IS_BIG_ENDIAN) {
+        for (;n>=8;n-=8,p+=8) {
+            memcpy(&lo,p,4);
+            memcpy(&hi,p+4,4);
+            lo ^= c;
+            c = t[7][lo&0xFF]^t[6][lo>>8&0xFF]^t[5][lo>>16&0xFF]^t[4][lo>>24]^
+                t[3][hi&0xFF]^t[2][hi>>8&0xFF]^t[1][hi>>16&0xFF]^t[0][hi>>24];
+        }
+    }
+    while (n--) c = c>>8^t[0][(c^*p++)&0xFF];
+    return c;
+}
 
+#if defined(__x86_64__)
+#define QOIG_CRC_HW (__builtin_cpu_supports("sse4.2"))
+__attribute__((target("sse4.2")))
+static uint32_t qoig_crc32c_hw(uint32_t c, const uint8_t *p, size_t n) {
+    uint64_t w, c64 = c;
+    
+    for (;n>=8;n-=8,p+=8) {
+        memcpy(&w,p,8);
+        c64 = _mm_crc32_u64(c64,w);
+    }
+    c = c64;
+    while (n--) c = _mm_crc32_u8(c,*p++);
+    return c;
+}
 
-                case OP_RUN:
-                    if (cbyte == OP_RGB || cbyte == OP_RGBA) {
-                        QOIG_READ(&current,1,3+(cbyte == OP_RGBA),infile);
-                        if (64-clen-2*cfg.longindex) {
-                            if (cfg.longindex) {
-                                temp = cache[LOCALHASH(current,clen,64-2*cfg.longindex)];
-                                if (!EQCOLOR(temp,current)) {
-                                    longcache2[LOCALHASH(temp,0,256)] = temp;
+//Three whole chunks at once. The crc32 instruction takes three cycles but a new
+//one can start every cycle, so three independent chunks cost about as much as one.
+__attribute__((target("sse4.2")))
+static void qoig_crc32c_hw3(const uint8_t *p, uint32_t *crc) {
+    uint64_t a = ~0u, b = ~0u, c = ~0u, w;
+    size_t i;
+    
+    for (i=0;i<QOIG_CRC_CHUNK;i+=8) {
+        memcpy(&w,p+i,8);
+        a = _mm_crc32_u64(a,w);
+        memcpy(&w,p+QOIG_CRC_CHUNK+i,8);
+        b = _mm_crc32_u64(b,w);
+        memcpy(&w,p+2*QOIG_CRC_CHUNK+i,8);
+        c = _mm_crc32_u64(c,w);
+    }
+    crc[0] = ~(uint32_t)a;
+    crc[1] = ~(uint32_t)b;
+    crc[2] = ~(uint32_t)c;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#define QOIG_CRC_HW 1
+static uint32_t qoig_crc32c_hw(uint32_t c, const uint8_t *p, size_t n) {
+    uint64_t w;
+    
+    for (;n>=8;n-=8,p+=8) {
+        memcpy(&w,p,8);
+        c = __crc32cd(c,w);
+    }
+    while (n--) c = __crc32cb(c,*p++);
+    return c;
+}
+#else
+#define QOIG_CRC_HW 0
+#define qoig_crc32c_hw qoig_crc32c_sw
+#endif
+
+//CRC32C of n bytes, continuing from crc (0 to start)
+uint32_t qoig_crc32c(uint32_t crc, const uint8_t *p, size_t n) {
+    return QOIG_CRC_HW ? ~qoig_crc32c_hw(~crc,p,n) : ~qoig_crc32c_sw(~crc,p,n);
+}
+
+//Find the checksum trailer of a QOIG file held in memory. Sets streamlen to the 
+//length of the checksummed stream, which the chunk CRCs follow. Fails if the
+//file has no trailer or the trailer itself is damaged.
+int qoig_crc_trailer(const uint8_t *in, size_t len, size_t *streamlen) {
+    uint32_t n, crc;
+    
+    if (len < 22 || memcmp(in,"qoi",3) || !(in[13]&QOIG_EXT_CRC)) return -1;
+    memcpy(&n,in+len-8,4);
+    memcpy(&crc,in+len-4,4);
+    n = ntohl(n);
+    if (n > (len-22)/4) return -1;
+    *streamlen = len-8-4*(size_t)n;
+    if (n != (*streamlen+QOIG_CRC_CHUNK-1)/QOIG_CRC_CHUNK) return -1;
+    return qoig_crc32c(0,in+*streamlen,4*(size_t)n+4) != ntohl(crc) ? -1 : 0;
+}
+
+//Check a whole QOIG file in memory against its trailer without decoding it.
+//Returns 0 if every chunk matches, -1 if there is no valid trailer, or 1 with
+//bad set to the offset of the first chunk that doesn't match.
+int qoig_verify(const uint8_t *in, size_t len, size_t *bad) {
+    size_t streamlen, i, j, k, n;
+    uint32_t crc[3], want;
+    
+    if (qoig_crc_trailer(in,len,&streamlen)) return -1;
+    n = (streamlen+QOIG_CRC_CHUNK-1)/QOIG_CRC_CHUNK;
+    for (i=0;i<n;i+=k) {
+#if defined(__x86_64__)
+        if (QOIG_CRC_HW && (i+3)*QOIG_CRC_CHUNK <= streamlen) {
+            qoig_crc32c_hw3(in+i*QOIG_CRC_CHUNK,crc);
+            k = 3;
+        } else
+#endif
+        {
+            k = streamlen-i*QOIG_CRC_CHUNK < QOIG_CRC_CHUNK ? streamlen-i*QOIG_CRC_CHUNK : QOIG_CRC_CHUNK;
+            crc[0] = qoig_crc32c(0,in+i*QOIG_CRC_CHUNK,k);
+            k = 1;
+        }
+        for (j=0;j<k;j++) {
+            memcpy(&want,in+streamlen+4*(i+j),4);
+            if (crc[j] != ntohl(want)) {
+                *bad = (i+j)*QOIG_CRC_CHUNK;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Primes of the pixel digest
+#define QOIG_P1 0x9E3779B185EBCA87ull
+#define QOIG_P2 0xC2B2AE3D27D4EB4Full
+#define QOIG_P3 0x165667B19E3779F9ull
+#define QOIG_ROTL(x,r) ((x)<<(r)|(x)>>(64-(r)))
+
+//8 bytes as a little endian number on any machine
+static inline uint64_t qoig_le64(const uint8_t *p) {
+    uint64_t w;
+    
+    memcpy(&w,p,8);
+    return IS_BIG_ENDIAN ? __builtin_bswap64(w) : w;
+}
+
+static inline uint64_t qoig_hash_round(uint64_t acc, uint64_t w) {
+    acc += w*QOIG_P2;
+    return QOIG_ROTL(acc,31)*QOIG_P1;
+}
+
+//64 bit hash of n bytes, continuing from h (0 to start). Not cryptographic:
+//it is for telling decoded images apart, built like xxHash64 with four lanes 
+//of 8 bytes so that it runs many times faster than the decoder.
+uint64_t qoig_hash64(uint64_t h, const uint8_t *p, size_t n) {
+    uint64_t v[4] = {h+QOIG_P1+QOIG_P2, h+QOIG_P2, h, h-QOIG_P1};
+    const uint8_t *end = p+n;
+    int i;
+    
+    if (n >= 32) {
+        for (;end-p >= 32;p+=32) {
+            for (i=0;i<4;i++) v[i] = qoig_hash_round(v[i],qoig_le64(p+8*i));
+        }
+        h = QOIG_ROTL(v[0],1)+QOIG_ROTL(v[1],7)+QOIG_ROTL(v[2],12)+QOIG_ROTL(v[3],18);
+        for (i=0;i<4;i++) h = (h^qoig_hash_round(0,v[i]))*QOIG_P1+QOIG_P3;
+    } else {
+        h += QOIG_P3;
+    }
+    h += n;
+    for (;end-p >= 8;p+=8) {
+        h ^= qoig_hash_round(0,qoig_le64(p));
+        h = QOIG_ROTL(h,27)*QOIG_P1+QOIG_P3;
+    }
+    for (;p<end;p++) {
+        h ^= *p*QOIG_P3;
+        h = QOIG_ROTL(h,11)*QOIG_P1;
+    }
+    //Spread every input bit over the whole result
+    h ^= h>>33;
+    h *= QOIG_P2;
+    h ^= h>>29;
+    h *= QOIG_P3;
+    return h^h>>32;
+}
+
+//Checksum output on its way out, keeping one CRC per chunk for the trailer.
+//With last, the final partial chunk is closed off too.
+static int qoig_encoder_checksum(qoig_encoder *e, const uint8_t *p, size_t n, int last) {
+    size_t take;
+    uint32_t temp;
+    
+    while (n || last && e->crcpos) {
+        take = QOIG_CRC_CHUNK-e->crcpos < n ? QOIG_CRC_CHUNK-e->crcpos : n;
+        e->crc = qoig_crc32c(e->crc,p,take);
+        e->crcpos += take;
+        p += take;
+        n -= take;
+        if (e->crcpos == QOIG_CRC_CHUNK || !n && last) {
+            if (qoig_grow(&e->crcs,&e->crccap,e->crclen+4)) return -1;
+            temp = htonl(e->crc);
+            memcpy(e->crcs+e->crclen,&temp,4);
+            e->crclen += 4;
+            e->crc = 0;
+            e->crcpos = 0;
+        }
+    }
+    return 0;
+}
+
+static int qoig_encoder_reserve(qoig_encoder *e, size_t len) {
+    return qoig_grow(&e->out,&e->outcap,e->outlen+len);
+}
+
+//Entropy code the byte codes collected in out, a block at a time, into ent.
+//Unless last, a partial block is held back until the rest of it arrives.
+static int qoig_encoder_blocks(qoig_encoder *e, int last) {
+    size_t pos = 0, n, len;
+    
+    while (e->outlen-pos >= QOIG_BLOCK || last && pos < e->outlen) {
+        n = e->outlen-pos < QOIG_BLOCK ? e->outlen-pos : QOIG_BLOCK;
+        if (qoig_grow(&e->ent,&e->entcap,e->entlen+133+n)) return -1;
+        len = qoig_huff_block(e->out+pos,n,e->ent+e->entlen);
+        e->entlen += len;
+        e->ct += len;
+        pos += n;
+    }
+    if (last) {
+        //End of stream marker
+        if (qoig_grow(&e->ent,&e->entcap,e->entlen+2)) return -1;
+        e->ent[e->entlen++] = 0;
+        e->ent[e->entlen++] = 0;
+        e->ct += 2;
+    }
+    memmove(e->out,e->out+pos,e->outlen-pos);
+    e->outlen -= pos;
+    return 0;
+}
+
+//Start an encoder on a new image and put the file header in its output.
+//Output buffers from an earlier image are kept for reuse.
+static int qoig_encoder_init(qoig_encoder *e, qoig_desc desc, qoig_cfg cfg) {
+    static const int cachelengths[31] = QOIG_CACHES;
+    uint8_t *out = e->out, *ent = e->ent, *crcs = e->crcs;
+    size_t outcap = e->outcap, entcap = e->entcap, crccap = e->crccap;
+    uint8_t *header, *p;
+    uint32_t temp;
+    size_t len = 14;
+    int i;
+    
+    memset(e,0,sizeof(qoig_encoder));
+    e->out = out;
+    e->outcap = outcap;
+    e->ent = ent;
+    e->entcap = entcap;
+    e->crcs = crcs;
+    e->crccap = crccap;
+    cfg.channels = desc.channels;
+    if (cfg.channels < 3) {
+        //Gray mode has no secondary caches, but its raw blocks take index 63
+        cfg.longindex = 0;
+        cfg.searchcache = 0;
+        cfg.bigcache = 0;
+        if (cfg.rawblocks && cfg.clen == 30) {
+            cfg.clen = 29;
+        }
+    }
+    if (cfg.bigcache && (cfg.bigcache < 7 || cfg.bigcache > 10)) {
+        return -1;
+    }
+    //Exact matches can't use index codes taken by prefixes
+    while (cachelengths[cfg.clen] > QOIG_NEAREND(cfg)) {
+        cfg.clen--;
+    }
+    if (cfg.channels != 4) {
+        cfg.alpha = 0;
+    }
+    if (!cfg.longindex || cfg.seed && !cfg.seed->n) {
+        cfg.seed = NULL;
+    }
+    //A palette takes the place of a dictionary
+    if (cfg.seed || cfg.channels < 3) {
+        cfg.dict = NULL;
+    }
+    if (cfg.seed || cfg.dict) {
+        desc.colorspace |= QOIG_EXT_SEED;
+    }
+    if (cfg.entropy) {
+        desc.colorspace |= QOIG_EXT_ENTROPY;
+    }
+    if (cfg.crc) {
+        desc.colorspace |= QOIG_EXT_CRC;
+    }
+    if (cfg.alpha) {
+        desc.colorspace |= QOIG_EXT_ALPHA;
+    }
+    if (cfg.bigcache) {
+        desc.colorspace |= QOIG_EXT_BIGCACHE;
+        len++;
+    }
+    //Appending would mean coding the last entropy coded block over again
+    if (cfg.entropy) {
+        cfg.state = 0;
+    }
+    if (cfg.state) {
+        desc.colorspace |= QOIG_EXT_STATE;
+    }
+    //Near-lossless error bounds are per channel of the untransformed color
+    if (cfg.channels < 3 || cfg.tolerance) {
+        cfg.xform = 0;
+    }
+    if (cfg.xform) {
+        desc.colorspace |= QOIG_EXT_MORE;
+        len++;
+    }
+    e->cfg = cfg;
+    e->desc = desc;
+    e->clen = cachelengths[cfg.clen];
+    e->current = QOIG_FIRST(cfg.channels);
+    qoig_init_caches(e->cache,e->longcache1,e->longcache2,e->clen,cfg);
+    if (cfg.seed) {
+        e->lprobe = qoig_seed_caches(e->longcache1,e->longcache2,cfg.seed,cfg.xform);
+        e->frozen = 1;
+        len += 2+cfg.seed->n*desc.channels;
+    } else if (cfg.dict) {
+        qoig_dict_caches(e->cache,e->longcache1,e->longcache2,e->clen,cfg,cfg.dict);
+        len += 5;
+    }
+    if (qoig_encoder_reserve(e,QOIG_SLACK+len) || cfg.entropy && qoig_grow(&e->ent,&e->entcap,len)) {
+        return -1;
+    }
+    
+    //Write file header. With entropy coding it stays out of the blocks.
+    header = cfg.entropy ? e->ent : e->out;
+    memcpy(header,"qoi",3);
+    header[3] = cfg.longruns<<7|(!cfg.longindex)<<6|(!cfg.rawblocks)<<5|(cfg.clen^24);
+    temp = htonl(desc.width);
+    memcpy(header+4,&temp,4);
+    temp = htonl(desc.height);
+    memcpy(header+8,&temp,4);
+    header[12] = desc.channels;
+    header[13] = desc.colorspace;
+    p = header+14;
+    if (cfg.xform) {
+        *p++ = QOIG_EXT2_XFORM;
+    }
+    if (cfg.bigcache) {
+        *p++ = cfg.bigcache;
+    }
+    if (cfg.seed) {
+        p[0] = QOIG_SEED_PALETTE;
+        p[1] = cfg.seed->n-1;
+        for (i=0;i<cfg.seed->n;i++) {
+            memcpy(p+2+i*desc.channels,&cfg.seed->colors[i],desc.channels);
+        }
+    } else if (cfg.dict) {
+        p[0] = QOIG_SEED_DICT;
+        temp = htonl(cfg.dict->id);
+        memcpy(p+1,&temp,4);
+    }
+    if (cfg.entropy) {
+        e->entlen = len;
+    } else {
+        e->outlen = len;
+    }
+    e->ct = len;
+    return 0;
+}
+
+void qoig_encoder_free(qoig_encoder *e) {
+    if (!e) return;
+    free(e->out);
+    free(e->ent);
+    free(e->crcs);
+    free(e);
+}
+
+//Set up an encoder and put the file header in its output
+qoig_encoder *qoig_encoder_new(qoig_desc desc, qoig_cfg cfg) {
+    qoig_encoder *e = calloc(1,sizeof(qoig_encoder));
+    
+    if (e && qoig_encoder_init(e,desc,cfg)) {
+        qoig_encoder_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+//Hand over everything encoded so far. Valid until the next push or finish.
+//Returns NULL if entropy coding runs out of memory.
+const uint8_t *qoig_encoder_output(qoig_encoder *e, size_t *len) {
+    uint8_t **buf = e->cfg.entropy ? &e->ent : &e->out;
+    size_t *n = e->cfg.entropy ? &e->entlen : &e->outlen;
+    size_t *cap = e->cfg.entropy ? &e->entcap : &e->outcap;
+    uint32_t temp;
+    
+    if (e->cfg.entropy && qoig_encoder_blocks(e,0)) return NULL;
+    if (e->cfg.crc && e->finished < 2) {
+        if (qoig_encoder_checksum(e,*buf,*n,e->finished)) return NULL;
+        if (e->finished) {
+            //Trailer: the chunk CRCs, their number, and a CRC of those
+            if (qoig_grow(buf,cap,*n+e->crclen+8)) return NULL;
+            memcpy(*buf+*n,e->crcs,e->crclen);
+            temp = htonl(e->crclen/4);
+            memcpy(*buf+*n+e->crclen,&temp,4);
+            temp = htonl(qoig_crc32c(0,*buf+*n,e->crclen+4));
+            memcpy(*buf+*n+e->crclen+4,&temp,4);
+            *n += e->crclen+8;
+            e->finished = 2;
+        }
+    }
+    *len = *n;
+    *n = 0;
+    return *buf;
+}
+
+//Near-lossless mode: the cheapest color the encoder can code from where it is
+//that is within cfg.tolerance of px on each color channel. Alpha stays exact.
+//Tried in order of cost: a run, an index into the main or exact match cache,
+//a diff and a luma from the last pixel; else px itself. The choice goes
+//through the encoder as usual, so later pixels are predicted from exactly what
+//the decoder will see. Half of each pixel's error is carried into what the next
+//one aims for, so slow gradients aren't all rounded the same way.
+static color qoig_snap(qoig_encoder *e, color px, color last) {
+    int tol = e->cfg.tolerance;
+    uint8_t *p = (uint8_t *)&px, *l = (uint8_t *)&last, *q;
+    int t[3], j, g;
+    color c;
+    
+    //Aim for px plus the carried error, staying within tolerance
+    for (j=0;j<3;j++) {
+        t[j] = p[j]+e->carry[j];
+        if (t[j] < p[j]-tol) t[j] = p[j]-tol;
+        if (t[j] > p[j]+tol) t[j] = p[j]+tol;
+        if (t[j] < 0) t[j] = 0;
+        if (t[j] > 255) t[j] = 255;
+    }
+    c = last;
+    if (NEARCOLOR(c,px,tol)) goto done;
+    if (e->clen) {
+        c = e->cache[HASH(px,e->clen)];
+        if (NEARCOLOR(c,px,tol) && HASH(c,e->clen) == HASH(px,e->clen)) goto done;
+    }
+    //Diff: each channel moves at most 2 down or 1 up
+    c = last;
+    q = (uint8_t *)&c;
+    for (j=0;j<3;j++) {
+        g = t[j]-l[j];
+        q[j] = l[j]+(g < -2 ? -2 : g > 1 ? 1 : g);
+    }
+    if (NEARCOLOR(c,px,tol)) goto done;
+    if (e->cfg.longindex) {
+        c = e->longcache1[LHASH(px)];
+        if (NEARCOLOR(c,px,tol) && (e->frozen || LHASH(c) == LHASH(px))) goto done;
+    }
+    if (e->cfg.bigcache) {
+        c = e->bigcache[BIGHASH(px,e->cfg.bigcache)];
+        if (NEARCOLOR(c,px,tol) && BIGHASH(c,e->cfg.bigcache) == BIGHASH(px,e->cfg.bigcache)) goto done;
+    }
+    //Luma: green moves -32 to 31, red and blue -8 to 7 more than green
+    c = last;
+    g = t[1]-l[1];
+    g = g < -32 ? -32 : g > 31 ? 31 : g;
+    q[1] = l[1]+g;
+    for (j=0;j<3;j+=2) {
+        q[j] = l[j]+g+(t[j]-l[j]-g < -8 ? -8 : t[j]-l[j]-g > 7 ? 7 : t[j]-l[j]-g);
+    }
+    if (NEARCOLOR(c,px,tol)) goto done;
+    c = px;
+    done:
+    for (j=0;j<3;j++) {
+        e->carry[j] = (t[j]-((uint8_t *)&c)[j])/2;
+    }
+    return c;
+}
+
+//Gray mode version of qoig_snap. A gray diff can also change alpha, and the
+//secondary caches don't exist.
+static color qoig_snap_gray(qoig_encoder *e, color px, color last) {
+    int tol = e->cfg.tolerance;
+    int t = px.red+e->carry[0], g;
+    color c;
+    
+    if (t < px.red-tol) t = px.red-tol;
+    if (t > px.red+tol) t = px.red+tol;
+    if (t < 0) t = 0;
+    if (t > 255) t = 255;
+    c = last;
+    if (c.green == px.green && abs(c.red-px.red) <= tol) goto done;
+    if (e->clen) {
+        c = e->cache[HASH(px,e->clen)];
+        if (c.green == px.green && abs(c.red-px.red) <= tol && HASH(c,e->clen) == HASH(px,e->clen)) goto done;
+    }
+    c = px;
+    g = t-last.red;
+    c.red = last.red+(g < -32 ? -32 : g > 31 ? 31 : g);
+    if (abs(c.red-px.red) > tol) c = px;
+    done:
+    e->carry[0] = (t-c.red)/2;
+    return c;
+}
+
+//Encode the next n pixels of the image (they need not line up with rows)
+int qoig_encoder_push(qoig_encoder *e, const color *px, size_t n) {
+    qoig_cfg cfg = e->cfg;
+    color *cache = e->cache;
+    color *longcache1 = e->longcache1;
+    color *longcache2 = e->longcache2;
+    color *bigcache = e->bigcache;
+    uint8_t *rgbbuffer = e->rgbbuffer;
+    color last;
+    color current = e->current;
+    color temp,temp2;
+    color big = {0};
+    size_t i;
+    int j;
+    char k,l;
+    uint8_t m;
+    uint8_t bufferedrgb = e->bufferedrgb;
+    uint8_t rgbrun = e->rgbrun;
+    uint32_t run = e->run;
+    uint8_t colorhash,lcolorhash;
+    uint32_t bighash = 0;
+    int clen = e->clen;
+    int lprobe = e->lprobe;
+    uint8_t frozen = e->frozen;
+    uint8_t *o;
+    
+    if (qoig_encoder_reserve(e,6*n+QOIG_SLACK)) return -1;
+    o = e->out+e->outlen;
+    for (i=0;i<n;i++) {
+        
+        last = current;
+        
+        //Get next pixel
+
+        //A repeat of the last pixel is a repeat whether transformed or not
+        if (!cfg.xform) {
+            current = px[i];
+        } else if (i && EQCOLOR(px[i],px[i-1])) {
+            current = last;
+        } else {
+            current = qoig_xform(px[i]);
+        }
+        if (cfg.tolerance) {
+            current = qoig_snap(e,current,last);
+        }
+
+        //Try to make run
+        if (EQCOLOR(current,last) && (run<QOIG_MAXRUN || cfg.longruns && run < QOIG_MAXRUN+32895)) {
+            run++;
+            continue;
+        }
+        if (run) {
+            QOIG_RUN(QOIG_PRINT);
+            if (EQCOLOR(current,last)) {
+                run++;
+                continue;
+            }
+        }
+        
+        //Every color other than a run goes into the big cache
+        if (cfg.bigcache) {
+            bighash = BIGHASH(current,cfg.bigcache);
+            big = bigcache[bighash];
+            bigcache[bighash] = current;
+        }
+
+        if (clen) {
+            //Try to make exact index into cache
+            colorhash = HASH(current,clen);
+            temp = cache[colorhash];
+            if (EQCOLOR(current,temp)) {
+                QOIG_PRINT(OP_INDEX|colorhash&OP_INDEX_ARG);
+                continue;
+            }
+
+            cache[colorhash] = current;
+            if (cfg.longindex) {
+                lcolorhash = LHASH(current);
+                temp2 = longcache1[lcolorhash];
+                if (frozen) {
+                    //Seeded cache never changes, but seeds may sit a few slots past their hash
+                    for (j=0;j<lprobe && !EQCOLOR(current,temp2);j++) {
+                        temp2 = longcache1[++lcolorhash];
+                    }
+                } else {
+                    longcache1[LHASH(temp)] = temp;
+                }
+                if (EQCOLOR(current,temp2)) {
+                    QOIG_PRINT(OP_INDEX|62&OP_INDEX_ARG);
+                    QOIG_PRINT(lcolorhash);
+                    continue;
+                }
+            }
+        }
+        
+        //Try to make index into the big cache
+        if (cfg.bigcache && EQCOLOR(current,big)) {
+            QOIG_PRINT(OP_INDEX|QOIG_NEAREND(cfg)+(bighash>>8));
+            QOIG_PRINT(bighash&0xFF);
+            continue;
+        }
+        
+        //Try to make exact diff with previous pixel
+        if (COLORRANGES(current,last) &&
+            current.alpha == last.alpha) {
+            QOIG_PRINT(OP_DIFF|(current.red-last.red+2&3)<<4|
+                                (current.green-last.green+2&3)<<2|
+                                    (current.blue-last.blue+2&3));
+            continue;
+        }
+
+
+        //Try to make luma diff with previous pixel
+        j = current.green-last.green;
+        if (j>-33 && j<32 && current.alpha == last.alpha) {
+            k = current.red-last.red-j;
+            l = current.blue-last.blue-j;
+            if (-9<k && -9<l && k<8 && l<8) {
+                QOIG_PRINT(OP_LUMA|(j+32&OP_LUMA_ARG));
+                QOIG_PRINT((k+8&15)<<4|l+8&15);
+                continue;
+            }
+        }
+        
+        //Try to change alpha alone or with a small diff
+        if (cfg.alpha && current.alpha != last.alpha) {
+            if (current.red == last.red && current.green == last.green && current.blue == last.blue) {
+                QOIG_PRINT(OP_ALPHA);
+                QOIG_PRINT(current.alpha);
+                continue;
+            }
+            if (COLORRANGES(current,last) && TUBITRANGE(current.alpha,last.alpha)) {
+                QOIG_PRINT(OP_ALPHADIFF);
+                QOIG_PRINT((current.red-last.red+2&3)<<6|(current.green-last.green+2&3)<<4|
+                           (current.blue-last.blue+2&3)<<2|(current.alpha-last.alpha+2&3));
+                continue;
+            }
+        }
+        if (QOIG_NEAREND(cfg)-clen) {
+            //Try to make diff index into cache
+            colorhash=m=LOCALHASH(current,clen,QOIG_NEAREND(cfg));
+            temp = cache[m];
+            if (COLORRANGES(current,temp) &&
+                current.alpha == temp.alpha) {
+                smalldiff:QOIG_PRINT(OP_INDEX|m&OP_INDEX_ARG);
+                QOIG_PRINT(OP_DIFF|(current.red-temp.red+2&3)<<4|
+                                        (current.green-temp.green+2&3)<<2|
+                                        (current.blue-temp.blue+2&3));
+                continue;
+            }
+            
+            //Next just search the entire cache for the nearest color
+            if (cfg.searchcache) {
+                for (j=clen;j<QOIG_NEAREND(cfg);j++) {
+                    temp2 = cache[j];
+                    if (COLORRANGES(current,temp2) && current.alpha == temp2.alpha) {
+                        temp = temp2;
+                        m=j;
+                        goto smalldiff;
+                    }
+                    k = current.green - temp2.green;
+                    if (k>-33 && k<32) {
+                        k = current.red-temp.red-j;
+                        l = current.blue-temp.blue-j;
+                        if (-9<k && -9<l && k<8 && l<8) {
+                            temp = temp2;
+                            m = j;
+                        }
+                    }
+                }
+            }
+
+            //Try to make luma index into cache
+            j = current.green-temp.green;
+            if (j>-33 && j<32 && current.alpha == temp.alpha) {
+                k = current.red-temp.red-j;
+                l = current.blue-temp.blue-j;
+                if (-9<k && -9<l && k<8 && l<8) {
+                    QOIG_PRINT(OP_INDEX|m&OP_INDEX_ARG);
+                    QOIG_PRINT(OP_LUMA|j+32&0x3F);
+                    QOIG_PRINT((k+8&15)<<4|l+8&15);
+                    continue;
+                }
+            }
+            //if we are buffering an RGB block, interrupting that to insert an long-indexed diff can cost an extra byte
+            if (cfg.longindex && !(rgbrun && bufferedrgb==OP_RGB && current.alpha==last.alpha)) {
+                //Try to make diff index into cache
+                m=LOCALHASH(current,0,256);
+                temp = longcache2[m];
+                if (COLORRANGES(current,temp) &&
+                    current.alpha == temp.alpha) {
+                    lsmalldiff:QOIG_PRINT(OP_INDEX|63&OP_INDEX_ARG);
+                    QOIG_PRINT(m);
+                    QOIG_PRINT(OP_DIFF|(current.red-temp.red+2&3)<<4|
+                                            (current.green-temp.green+2&3)<<2|
+                                            (current.blue-temp.blue+2&3));
+                    continue;
+                }
+                
+                //Next just search the entire cache for the nearest color
+                if (cfg.searchcache) {
+                    for (j=0;j<256;j++) {
+                        temp2 = longcache2[j];
+                        if (COLORRANGES(current,temp2) && current.alpha == temp2.alpha) {
+                            temp = temp2;
+                            m=j;
+                            goto lsmalldiff;
+                        }
+                        if (current.alpha != last.alpha) {
+                            k = current.green - temp2.green;
+                            if (k>-33 && k<32) {
+                                k = current.red-temp.red-j;
+                                l = current.blue-temp.blue-j;
+                                if (-9<k && -9<l && k<8 && l<8) {
+                                    temp = temp2;
+                                    m = j;
                                 }
                             }
-                            cache[LOCALHASH(current,clen,64-2*cfg.longindex)] = current;
                         }
+                    }
+                }
+                
+                //Try to make luma index into cache
+                //There are no savings here if current alpha matches previous,
+                //and it's faster to just use an OP_RGB
+                //Likewise, interrupting an rgbrun for a long-indexed luma can cost an extra byte
+                if (current.alpha != last.alpha && !rgbrun) {
+                    j = current.green-temp.green;
+                    if (j>-33 && j<32 && current.alpha == temp.alpha) {
+                        k = current.red-temp.red-j;
+                        l = current.blue-temp.blue-j;
+                        if (-9<k && -9<l && k<8 && l<8) {
+                            QOIG_PRINT(OP_INDEX|63&OP_INDEX_ARG);
+                            QOIG_PRINT(m);
+                            QOIG_PRINT(OP_LUMA|j+32&0x3F);
+                            QOIG_PRINT((k+8&15)<<4|l+8&15);
+                            continue;
+                        }
+                    }
+                }
+            }
+        }
+
+        //Try to make RGB or RGBA pixel
+        //If we're buffering a pixel write, switch to raw mode and write it
+        if (cfg.rawblocks) {
+            if (rgbrun==129 || rgbrun && (bufferedrgb == OP_RGB && current.alpha!=last.alpha ||
+                bufferedrgb == OP_RGBA && current.alpha==last.alpha)) {
+                *o++ = OP_RGBRUN;
+                *o++ = rgbrun-2|(bufferedrgb&1)<<7;
+                memcpy(o,rgbbuffer,rgbrun*(bufferedrgb-0xFB));
+                o += rgbrun*(bufferedrgb-0xFB);
+                rgbrun=0;
+                bufferedrgb = 0;
+            }
+            if (bufferedrgb||rgbrun) {
+                if (bufferedrgb == OP_RGB && current.alpha!=last.alpha) {
+                    bufferedrgb = 0;
+                    QOIG_PRINT(OP_RGB);
+                    memcpy(o,&last,3);
+                    o += 3;
+                    bufferedrgb = OP_RGBA;
+                } else {
+                    if (!rgbrun) {
+                        memcpy(rgbbuffer,&last,3+(bufferedrgb&1));
+                        rgbrun=1;
+                    }
+                    memcpy(rgbbuffer+(3+(bufferedrgb&1))*rgbrun,&current,3+(bufferedrgb&1));
+                    rgbrun++;
+                }
+            } else {
+                if (current.alpha == last.alpha) {
+                    bufferedrgb = OP_RGB;
+                } else {
+                    bufferedrgb = OP_RGBA;
+                }
+            }
+        } else {
+            if (current.alpha == last.alpha) {
+                QOIG_PRINT(OP_RGB);
+                j=3;
+            } else {
+                QOIG_PRINT(OP_RGBA);
+                j=4;
+            }
+            memcpy(o,&current,j);
+            o += j;
+        }
+        if (QOIG_NEAREND(cfg)-clen) {
+            if (cfg.longindex) {
+                temp = cache[colorhash];
+                if (!EQCOLOR(temp,current)) {
+                    longcache2[LOCALHASH(temp,0,256)] = temp;
+                }
+            }
+            cache[colorhash] = current;
+        }
+    }
+    e->current = current;
+    e->run = run;
+    e->bufferedrgb = bufferedrgb;
+    e->rgbrun = rgbrun;
+    if (!cfg.entropy) e->ct += o-(e->out+e->outlen);
+    e->outlen = o-e->out;
+    return 0;
+}
+
+//Encode the next n pixels of a gray image, given as 1 or 2 bytes each
+int qoig_encoder_push_gray(qoig_encoder *e, const uint8_t *px, size_t n) {
+    qoig_cfg cfg = e->cfg;
+    color *cache = e->cache;
+    uint8_t *rgbbuffer = e->rgbbuffer;
+    color last;
+    color current = e->current;
+    size_t i;
+    char j;
+    uint8_t rgbrun = e->rgbrun;
+    uint32_t run = e->run;
+    uint8_t colorhash;
+    int clen = e->clen;
+    uint8_t *o;
+    
+    if (qoig_encoder_reserve(e,3*n+QOIG_SLACK)) return -1;
+    o = e->out+e->outlen;
+    for (i=0;i<n;i++,px+=cfg.channels) {
+        
+        last = current;
+        current.red = px[0];
+        if (cfg.channels == 2) current.green = px[1];
+        if (cfg.tolerance) {
+            current = qoig_snap_gray(e,current,last);
+        }
+
+        //Try to make run
+        if (EQCOLOR(current,last) && (run<QOIG_MAXRUN || cfg.longruns && run < QOIG_MAXRUN+32895)) {
+            run++;
+            continue;
+        }
+        if (run) {
+            QOIG_RUN(QOIG_GPRINT);
+            if (EQCOLOR(current,last)) {
+                run++;
+                continue;
+            }
+        }
+
+        //Try to make exact index into cache
+        if (clen) {
+            colorhash = HASH(current,clen);
+            if (EQCOLOR(current,cache[colorhash])) {
+                QOIG_GPRINT(OP_INDEX|colorhash);
+                continue;
+            }
+            cache[colorhash] = current;
+        }
+        
+        //Try to make diff with previous pixel, changing alpha too if needed
+        j = current.red-last.red;
+        if (j>-33 && j<32) {
+            if (current.green == last.green) {
+                QOIG_GPRINT(OP_DIFF|j+32);
+            } else {
+                QOIG_GPRINT(OP_LUMA|j+32);
+                *o++ = current.green-last.green;
+            }
+            continue;
+        }
+        
+        //Gray literal, queued into a raw block if allowed
+        if (current.green != last.green) {
+            QOIG_GPRINT(OP_RGBA);
+            *o++ = current.red;
+            *o++ = current.green;
+        } else if (cfg.rawblocks) {
+            if (rgbrun == 255) {
+                *o++ = OP_INDEX|63;
+                *o++ = rgbrun-1;
+                memcpy(o,rgbbuffer,rgbrun);
+                o += rgbrun;
+                rgbrun = 0;
+            }
+            rgbbuffer[rgbrun++] = current.red;
+        } else {
+            QOIG_GPRINT(OP_RGB);
+            *o++ = current.red;
+        }
+    }
+    e->current = current;
+    e->run = run;
+    e->rgbrun = rgbrun;
+    if (!cfg.entropy) e->ct += o-(e->out+e->outlen);
+    e->outlen = o-e->out;
+    return 0;
+}
+
+//Bytes of the state trailer for an encoder holding rgbrun literals
+static size_t qoig_state_size(qoig_cfg cfg, uint8_t bufferedrgb, uint8_t rgbrun) {
+    size_t n = 22+64*4+4;
+    
+    n += rgbrun*(cfg.channels < 3 ? 1 : 3+(bufferedrgb&1));
+    if (cfg.longindex) n += 2*256*4;
+    if (cfg.bigcache) n += 4<<cfg.bigcache;
+    return n;
+}
+
+//Write the state trailer for an encoder about to finish, keep bytes into the
+//stream. Returns the end of what was written.
+static uint8_t *qoig_encoder_state(qoig_encoder *e, uint8_t *o, uint64_t keep) {
+    qoig_cfg cfg = e->cfg;
+    uint8_t *start = o;
+    uint32_t temp;
+    size_t n;
+    int i;
+    
+    temp = htonl(keep>>32);
+    memcpy(o,&temp,4);
+    temp = htonl(keep&0xFFFFFFFF);
+    memcpy(o+4,&temp,4);
+    memcpy(o+8,&e->current,4);
+    temp = htonl(e->run);
+    memcpy(o+12,&temp,4);
+    o[16] = e->bufferedrgb;
+    o[17] = e->rgbrun;
+    for (i=0;i<3;i++) o[18+i] = e->carry[i];
+    o[21] = e->lprobe;
+    o += 22;
+    n = e->rgbrun*(cfg.channels < 3 ? 1 : 3+(e->bufferedrgb&1));
+    memcpy(o,e->rgbbuffer,n);
+    o += n;
+    memcpy(o,e->cache,64*4);
+    o += 64*4;
+    if (cfg.longindex) {
+        memcpy(o,e->longcache1,256*4);
+        memcpy(o+256*4,e->longcache2,256*4);
+        o += 2*256*4;
+    }
+    if (cfg.bigcache) {
+        memcpy(o,e->bigcache,4<<cfg.bigcache);
+        o += 4<<cfg.bigcache;
+    }
+    temp = htonl(o-start);
+    memcpy(o,&temp,4);
+    return o+4;
+}
+
+//Flush pending runs and raw blocks and write the end of stream marker
+int qoig_encoder_finish(qoig_encoder *e) {
+    qoig_cfg cfg = e->cfg;
+    uint8_t *rgbbuffer = e->rgbbuffer;
+    color last = e->current;
+    uint8_t bufferedrgb = e->bufferedrgb;
+    uint8_t rgbrun = e->rgbrun;
+    uint32_t run = e->run;
+    //Where an append would pick up from
+    unsigned long keep = e->ct;
+    uint8_t *o;
+    
+    if (qoig_encoder_reserve(e,QOIG_SLACK+(cfg.state ? qoig_state_size(cfg,bufferedrgb,rgbrun) : 0))) return -1;
+    o = e->out+e->outlen;
+    if (cfg.channels < 3) {
+        if (run) {
+            QOIG_RUN(QOIG_GPRINT);
+        }
+        QOIG_GPRINT(0);
+    } else {
+        if (run) {
+            QOIG_RUN(QOIG_PRINT);
+        }
+        //Flush all buffers
+        QOIG_PRINT(0);
+    }
+    //I have no idea what the file footer is for.
+    //Only 7 more bytes because QOIG_PRINT wrote the first
+    memcpy(o,"\0\0\0\0\0\0\1",7);
+    o += 7;
+    if (cfg.state) {
+        o = qoig_encoder_state(e,o,keep);
+    }
+    e->run = 0;
+    e->bufferedrgb = 0;
+    e->rgbrun = 0;
+    e->finished = 1;
+    if (cfg.entropy) {
+        e->outlen = o-e->out;
+        if (qoig_encoder_blocks(e,1)) return -1;
+    } else {
+        e->ct += o-(e->out+e->outlen);
+        e->outlen = o-e->out;
+    }
+    //The trailer itself is added by qoig_encoder_output
+    if (cfg.crc) {
+        e->ct += 4*((e->ct+QOIG_CRC_CHUNK-1)/QOIG_CRC_CHUNK)+8;
+    }
+    return 0;
+}
+
+//Pick up where the encoder that wrote a file with a state trailer left off, as
+//if it had never been finished, to push rows more onto the bottom of the image.
+//The stream from *keep on is to be replaced by what the encoder outputs from
+//here. Its checksums already count the header as rewritten for rows more rows,
+//and desc.height is set to rows, the number left to push. Options that aren't
+//stored in the file (searchcache, tolerance) come from cfg.
+qoig_encoder *qoig_encoder_reopen(const uint8_t *in, size_t len, qoig_cfg cfg, uint32_t rows, size_t *keep) {
+    static const int cachelengths[31] = QOIG_CACHES;
+    qoig_encoder *e = NULL;
+    qoig_desc desc;
+    const uint8_t *s, *p = in+14;
+    uint8_t header[14];
+    size_t streamlen = len, statelen, at, n, i;
+    uint32_t temp, hi;
+    
+    if (len < 14 || memcmp(in,"qoi",3) || in[13]&~QOIG_EXT_KNOWN ||
+        (in[13]&(QOIG_EXT_STATE|QOIG_EXT_ENTROPY)) != QOIG_EXT_STATE) return NULL;
+    if (in[13]&QOIG_EXT_CRC && qoig_crc_trailer(in,len,&streamlen)) return NULL;
+    memcpy(&temp,in+4,4);
+    desc.width = ntohl(temp);
+    memcpy(&temp,in+8,4);
+    desc.height = ntohl(temp);
+    desc.channels = in[12];
+    desc.colorspace = in[13];
+    if (desc.channels < 1 || desc.channels > 4 || desc.height > UINT32_MAX-rows) return NULL;
+    
+    //The same settings as the file, as qoig_decoder_header reads them
+    cfg.channels = desc.channels;
+    cfg.clen = (in[3]&0x1F)^24;
+    cfg.longruns = in[3]>>7;
+    cfg.longindex = desc.channels > 2 && !(in[3]>>6&1);
+    cfg.rawblocks = !(in[3]>>5&1);
+    cfg.crc = !!(desc.colorspace&QOIG_EXT_CRC);
+    cfg.alpha = !!(desc.colorspace&QOIG_EXT_ALPHA);
+    //The bytes after the header, as far as the state trailer needs them
+    if (len < 14+!!(desc.colorspace&QOIG_EXT_MORE)+!!(desc.colorspace&QOIG_EXT_BIGCACHE)+!!(desc.colorspace&QOIG_EXT_SEED) ||
+        desc.colorspace&QOIG_EXT_MORE && *p&~QOIG_EXT2_KNOWN) return NULL;
+    cfg.xform = desc.colorspace&QOIG_EXT_MORE && *p++&QOIG_EXT2_XFORM;
+    cfg.bigcache = desc.colorspace&QOIG_EXT_BIGCACHE ? *p++ : 0;
+    if (cfg.xform) cfg.tolerance = 0;
+    cfg.entropy = 0;
+    cfg.state = 1;
+    cfg.seed = NULL;
+    cfg.dict = NULL;
+    if (cfg.clen > 30 || cfg.alpha && desc.channels != 4 || (desc.colorspace&QOIG_EXT_BIGCACHE || cfg.xform) && desc.channels < 3) return NULL;
+    
+    //The state trailer ends the stream, with its length last
+    if (streamlen < 14+8+4) return NULL;
+    memcpy(&temp,in+streamlen-4,4);
+    statelen = ntohl(temp);
+    if (statelen < 22 || statelen > streamlen-14-8-4) return NULL;
+    s = in+streamlen-4-statelen;
+    memcpy(&hi,s,4);
+    memcpy(&temp,s+4,4);
+    at = (uint64_t)ntohl(hi)<<32|ntohl(temp);
+    if (at < 14 || at+8 > (size_t)(s-in) || s[17] > (desc.channels < 3 ? 255 : 129) ||
+        desc.channels > 2 && s[16] && s[16] != OP_RGB && s[16] != OP_RGBA || desc.channels < 3 && s[16] ||
+        statelen+4 != qoig_state_size(cfg,s[16],s[17])) return NULL;
+    
+    e = qoig_encoder_new(desc,cfg);
+    if (!e || e->clen != cachelengths[cfg.clen]) goto error;
+    e->desc = desc;
+    e->desc.height = rows;
+    e->outlen = 0;
+    e->ct = at;
+    e->frozen = desc.colorspace&QOIG_EXT_SEED && *p == QOIG_SEED_PALETTE;
+    memcpy(&e->current,s+8,4);
+    memcpy(&temp,s+12,4);
+    e->run = ntohl(temp);
+    e->bufferedrgb = s[16];
+    e->rgbrun = s[17];
+    for (i=0;i<3;i++) e->carry[i] = (int8_t)s[18+i];
+    e->lprobe = s[21];
+    s += 22;
+    n = e->rgbrun*(desc.channels < 3 ? 1 : 3+(e->bufferedrgb&1));
+    memcpy(e->rgbbuffer,s,n);
+    s += n;
+    memcpy(e->cache,s,64*4);
+    s += 64*4;
+    if (cfg.longindex) {
+        memcpy(e->longcache1,s,256*4);
+        memcpy(e->longcache2,s+256*4,256*4);
+        s += 2*256*4;
+    }
+    if (cfg.bigcache) {
+        memcpy(e->bigcache,s,4<<cfg.bigcache);
+    }
+    
+    if (cfg.crc) {
+        //Chunks kept whole keep their CRCs, except the first, which has the header
+        memcpy(header,in,14);
+        temp = htonl(desc.height+rows);
+        memcpy(header+8,&temp,4);
+        n = at/QOIG_CRC_CHUNK;
+        if (qoig_grow(&e->crcs,&e->crccap,4*n+4)) goto error;
+        memcpy(e->crcs,in+streamlen,4*n);
+        e->crclen = 4*n;
+        e->crcpos = at%QOIG_CRC_CHUNK;
+        e->crc = qoig_crc32c(0,in+at-e->crcpos,e->crcpos);
+        if (n) {
+            temp = htonl(qoig_crc32c(qoig_crc32c(0,header,14),in+14,QOIG_CRC_CHUNK-14));
+            memcpy(e->crcs,&temp,4);
+        } else {
+            e->crc = qoig_crc32c(qoig_crc32c(0,header,14),in+14,at-14);
+        }
+    }
+    *keep = at;
+    return e;
+    error:
+        qoig_encoder_free(e);
+        return NULL;
+}
+
+//Fit a view to an image of width by height, filling in its defaults.
+//Fails if it doesn't overlap the image.
+static int qoig_view_fit(qoig_view *v, uint32_t width, uint32_t height) {
+    if (!v->scale) v->scale = 1;
+    if (v->x >= width || v->y >= height || v->scale > 16) return -1;
+    if (!v->width || v->width > width-v->x) v->width = width-v->x;
+    if (!v->height || v->height > height-v->y) v->height = height-v->y;
+    return 0;
+}
+
+//Size of a fitted view once shrunk
+#define QOIG_SHRUNK(n,scale) (((n)+(scale)-1)/(scale))
+
+//Rows of an image on their way to being cropped and shrunk to a view
+typedef struct {
+    qoig_view v;
+    size_t bpp;
+    uint32_t width;
+    uint32_t *sum;
+    uint8_t *row;
+} qoig_shrink;
+
+static int qoig_shrink_init(qoig_shrink *s, qoig_view v, size_t bpp) {
+    s->v = v;
+    s->bpp = bpp;
+    s->width = QOIG_SHRUNK(v.width,v.scale);
+    s->sum = NULL;
+    s->row = NULL;
+    if (v.scale == 1) return 0;
+    s->sum = calloc((size_t)s->width*bpp,sizeof(uint32_t));
+    s->row = malloc((size_t)s->width*bpp);
+    return s->sum && s->row ? 0 : -1;
+}
+
+static void qoig_shrink_free(qoig_shrink *s) {
+    free(s->sum);
+    free(s->row);
+}
+
+//Take row y of the image, bpp bytes a pixel. Returns the next row of the view
+//once it is complete, or NULL. Colors are averaged weighted by alpha, so fully
+//transparent pixels don't bleed into their neighbors.
+static const uint8_t *qoig_shrink_row(qoig_shrink *s, const uint8_t *row, uint32_t y) {
+    qoig_view v = s->v;
+    size_t bpp = s->bpp, a = bpp == 2 || bpp == 4 ? bpp-1 : bpp;
+    uint32_t *sum = s->sum;
+    uint32_t x, k, n, boxh, alpha;
+    size_t c;
+    
+    if (y < v.y || y-v.y >= v.height) return NULL;
+    row += (size_t)v.x*bpp;
+    if (v.scale == 1) return row;
+    for (x=0;x<v.width;x++,row+=bpp) {
+        k = x/v.scale*bpp;
+        if (a < bpp) {
+            for (c=0;c<a;c++) sum[k+c] += row[c]*row[a];
+            sum[k+a] += row[a];
+        } else {
+            for (c=0;c<bpp;c++) sum[k+c] += row[c];
+        }
+    }
+    if ((y-v.y+1)%v.scale && y-v.y+1 < v.height) return NULL;
+    
+    boxh = (y-v.y)%v.scale+1;
+    for (x=0,k=0;x<s->width;x++,k+=bpp) {
+        n = boxh*(x == s->width-1 ? v.width-x*v.scale : v.scale);
+        if (a < bpp) {
+            alpha = sum[k+a];
+            for (c=0;c<a;c++) s->row[k+c] = alpha ? (sum[k+c]+alpha/2)/alpha : 0;
+            s->row[k+a] = (alpha+n/2)/n;
+        } else {
+            for (c=0;c<bpp;c++) s->row[k+c] = (sum[k+c]+n/2)/n;
+        }
+    }
+    memset(sum,0,(size_t)s->width*bpp*sizeof(uint32_t));
+    return s->row;
+}
+
+//Adam7 PNGs come a pass at a time, each pass filling in more pixels of rows 
+//spread over the whole image, so no row is complete until the last pass. Decode
+//the first rows rows of one into an unlinked temporary file mapped in memory:
+//the kernel can write it out and drop it from RAM as it goes, so even huge 
+//images need little memory. Sets img to NULL if the PNG isn't interlaced, so its
+//rows can just be decoded one at a time. row is scratch space of rowbytes.
+static int qoig_deinterlace(spng_ctx *ctx, size_t rowbytes, uint32_t rows, uint8_t *row, uint8_t **img, size_t *len) {
+    struct spng_ihdr ihdr;
+    struct spng_row_info info;
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    int fd, ret, pass = 0;
+    
+    *img = NULL;
+    *len = rowbytes*rows;
+    if (spng_get_ihdr(ctx,&ihdr)) return -1;
+    if (!ihdr.interlace_method || !*len) return 0;
+    //Not /tmp unless asked, which is often kept in memory
+    snprintf(path,sizeof(path),"%s/qoigXXXXXX",dir && *dir ? dir : "/var/tmp");
+    if ((fd = mkstemp(path)) < 0 && !(dir && *dir)) {
+        strcpy(path,"/tmp/qoigXXXXXX");
+        fd = mkstemp(path);
+    }
+    if (fd < 0) return -1;
+    unlink(path);
+    //Take the space now: running out of it while writing through the mapping
+    //would be a SIGBUS rather than an error
+    if (posix_fallocate(fd,0,*len) || (*img = mmap(NULL,*len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0)) == MAP_FAILED) {
+        *img = NULL;
+        close(fd);
+        return -1;
+    }
+    
+    //spng puts the pixels of each pass where they belong in a full row
+    while (!(ret = spng_get_row_info(ctx,&info))) {
+        //The last pass is every other row in order, so it can stop early
+        if (info.pass == 6 && info.row_num >= rows) break;
+        if (info.pass != pass) {
+#ifdef SYNC_FILE_RANGE_WRITE
+            //Start writing back the passes done so far
+            sync_file_range(fd,0,0,SYNC_FILE_RANGE_WRITE);
+#endif
+            pass = info.pass;
+        }
+        ret = spng_decode_row(ctx,info.row_num < rows ? *img+info.row_num*rowbytes : row,rowbytes);
+        if (ret) break;
+    }
+    close(fd);
+    if (ret && ret != SPNG_EOI) {
+        munmap(*img,*len);
+        *img = NULL;
+        return -1;
+    }
+    madvise(*img,*len,MADV_SEQUENTIAL);
+    return 0;
+}
+
+//Encode rows decoded by spng, writing the result to outfile unless simulating.
+//Only the part of the image in cfg.view is encoded, at the size the encoder 
+//was set up with; rows below it aren't even decoded.
+int qoig_encode(spng_ctx *ctx, qoig_encoder *e, FILE *outfile, unsigned long *outlen) {
+    struct spng_ihdr ihdr;
+    qoig_view view = e->cfg.view;
+    qoig_shrink shrink = {0};
+    //Gray rows come from spng as 1 or 2 bytes per pixel
+    size_t bpp = e->desc.channels<3 ? e->desc.channels : 4;
+    size_t width = e->desc.width;
+    const uint8_t *out, *src;
+    uint8_t *img = NULL;
+    color *row = NULL;
+    size_t n,len,imglen;
+    uint32_t y, oy = 0, rows;
+    int ret = -1;
+    
+    if (spng_get_ihdr(ctx,&ihdr) || qoig_view_fit(&view,ihdr.width,ihdr.height) ||
+        QOIG_SHRUNK(view.width,view.scale) != width || QOIG_SHRUNK(view.height,view.scale) != e->desc.height ||
+        qoig_shrink_init(&shrink,view,bpp) || !(row = malloc(sizeof(color)*ihdr.width+1))) goto done;
+    //A simulated encode only looks at the first few rows
+    rows = view.height;
+    if (e->cfg.bytecap && width && e->cfg.bytecap/width < e->desc.height) {
+        rows = (e->cfg.bytecap+width-1)/width*view.scale;
+        if (rows > view.height) rows = view.height;
+    }
+    rows += view.y;
+    if (qoig_deinterlace(ctx,bpp*ihdr.width,rows,(uint8_t *)row,&img,&imglen)) goto done;
+    for (y=0;y<rows;y++) {
+        if (img) {
+            src = img+y*bpp*ihdr.width;
+        } else {
+            ret = spng_decode_row(ctx, row, bpp*ihdr.width);
+            if (ret && ret != SPNG_EOI) goto done;
+            ret = -1;
+            src = (uint8_t *)row;
+        }
+        if (!(src = qoig_shrink_row(&shrink,src,y))) continue;
+        n = width;
+        if (e->cfg.bytecap) {
+            if (oy*width >= e->cfg.bytecap) break;
+            if (e->cfg.bytecap-oy*width < n) n = e->cfg.bytecap-oy*width;
+        }
+        oy++;
+        if (bpp<4 ? qoig_encoder_push_gray(e,src,n) : qoig_encoder_push(e,(const color *)src,n)) goto done;
+        out = qoig_encoder_output(e,&len);
+        if (!out) goto done;
+        if (!e->cfg.simulate && fwrite(out,1,len,outfile) != len) goto done;
+    }
+    if (qoig_encoder_finish(e)) goto done;
+    out = qoig_encoder_output(e,&len);
+    if (!out) goto done;
+    if (!e->cfg.simulate && fwrite(out,1,len,outfile) != len) goto done;
+    *outlen = e->ct;
+    ret = 0;
+    done:
+        if (img) munmap(img,imglen);
+        qoig_shrink_free(&shrink);
+        free(row);
+        return ret;
+}
+
+//Map a whole file for reading. Falls back to reading it into memory when
+//it can't be mapped (pipes, odd filesystems).
+int qoig_map(const char *path, qoig_buf *buf) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    void *p;
+    
+    buf->data = NULL;
+    buf->mapped = 0;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) || !st.st_size) {
+        close(fd);
+        return -1;
+    }
+    buf->len = st.st_size;
+    p = mmap(NULL, buf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+        madvise(p, buf->len, MADV_SEQUENTIAL);
+        buf->mapped = 1;
+    } else {
+        FILE *f = fdopen(fd, "rb");
+        p = malloc(buf->len);
+        if (!f || !p || fread(p, 1, buf->len, f) != buf->len) {
+            free(p);
+            if (f) fclose(f); else close(fd);
+            return -1;
+        }
+        fclose(f);
+        buf->data = p;
+        return 0;
+    }
+    close(fd);
+    buf->data = p;
+    return 0;
+}
+
+//Ask the kernel to start reading a file that will be needed soon, without
+//waiting for it. The later qoig_map then finds it in the page cache.
+void qoig_prefetch(const char *path) {
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+//Close an output file and start writing it back right away, rather than once
+//dirty pages pile up and the kernel makes whoever writes next wait for them
+int qoig_close(FILE *f) {
+    if (fflush(f)) {
+        fclose(f);
+        return -1;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fileno(f), 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+    return fclose(f);
+}
+
+void qoig_unmap(qoig_buf *buf) {
+    if (!buf->data) return;
+    if (buf->mapped) {
+        munmap((void *)buf->data, buf->len);
+    } else {
+        free((void *)buf->data);
+    }
+    buf->data = NULL;
+}
+
+//Set up a decoder. The configuration comes from the file header once it arrives.
+qoig_decoder *qoig_decoder_new() {
+    return calloc(1,sizeof(qoig_decoder));
+}
+
+void qoig_decoder_free(qoig_decoder *d) {
+    if (!d) return;
+    free(d->row);
+    free(d->blk);
+    free(d->plain);
+    free(d);
+}
+
+//Make a decoder ready for another file, keeping its buffers.
+//The dictionary and checksums have to be given again.
+void qoig_decoder_reset(qoig_decoder *d) {
+    uint8_t *row = d->row, *blk = d->blk, *plain = d->plain;
+    size_t rowcap = d->rowcap;
+    
+    memset(d,0,sizeof(qoig_decoder));
+    d->row = row;
+    d->rowcap = rowcap;
+    d->blk = blk;
+    d->plain = plain;
+}
+
+//The row finished by the last call to qoig_decoder_push that returned QOIG_ROW
+const uint8_t *qoig_decoder_row(qoig_decoder *d) {
+    return d->row;
+}
+
+static int qoig_decoder_header(qoig_decoder *d, const uint8_t *header) {
+    static const int cachelengths[31] = QOIG_CACHES;
+    uint8_t flags = header[3];
+    
+	//Check magic string
+    if (memcmp(header,"qoi",3)) return -1;
+    
+    //Extract desc from header and fix byte order on dimensions
+    memcpy(&d->desc.width,header+4,4);
+    memcpy(&d->desc.height,header+8,4);
+    d->desc.width = ntohl(d->desc.width);
+    d->desc.height = ntohl(d->desc.height);
+    d->desc.channels = header[12];
+    d->desc.colorspace = header[13];
+    if (d->desc.channels<1 || d->desc.channels>4) return -1;
+    if (d->desc.colorspace&~QOIG_EXT_KNOWN) return -1;
+    
+    //Create config
+    d->cfg.clen = (flags&0x1F)^24;
+    d->cfg.longruns = flags>>7;
+    d->cfg.longindex = !(flags>>6&1);
+    d->cfg.rawblocks = !(flags>>5&1);
+    d->cfg.channels = d->desc.channels;
+    if (d->cfg.channels < 3) d->cfg.longindex = 0;
+    d->cfg.entropy = !!(d->desc.colorspace&QOIG_EXT_ENTROPY);
+    d->cfg.crc = !!(d->desc.colorspace&QOIG_EXT_CRC);
+    d->cfg.alpha = !!(d->desc.colorspace&QOIG_EXT_ALPHA);
+    d->cfg.state = !!(d->desc.colorspace&QOIG_EXT_STATE);
+    d->cfg.xform = 0;
+    if (d->cfg.clen>30 || d->cfg.alpha && d->cfg.channels != 4) return -1;
+    if (d->desc.colorspace&QOIG_EXT_BIGCACHE && d->cfg.channels < 3) return -1;
+    d->clen = cachelengths[d->cfg.clen];
+    
+    d->current = QOIG_FIRST(d->cfg.channels);
+    qoig_init_caches(d->cache,d->longcache1,d->longcache2,d->clen,d->cfg);
+    d->rowlen = (size_t)d->desc.width*d->desc.channels;
+    if (qoig_grow(&d->row,&d->rowcap,d->rowlen ? d->rowlen : 1)) return -1;
+    if (d->cfg.entropy) {
+        if (!d->blk) d->blk = malloc(133+QOIG_BLOCK);
+        if (!d->plain) d->plain = malloc(QOIG_BLOCK);
+        d->blkneed = 2;
+        if (!d->blk || !d->plain) return -1;
+    }
+    return 0;
+}
+
+//Gray mode version of qoig_decode_span
+static size_t qoig_decode_gray_span(qoig_decoder *d, const uint8_t *in, size_t inlen) {
+    qoig_cfg cfg = d->cfg;
+    color *cache = d->cache;
+    color current = d->current;
+    color saved;
+    uint8_t cbyte = d->cbyte;
+    uint8_t rgbrun = d->rgbrun;
+    uint8_t savedcbyte,savedrgbrun;
+    size_t i;
+    size_t pos = 0, start = 0;
+    uint8_t j,m;
+    uint32_t run = d->run;
+    uint8_t *row = d->row;
+    int clen = d->clen;
+    
+    for (i=d->x;i<d->rowlen;i+=cfg.channels) {
+        //Add another pixel for current run
+        if (run) {
+            memcpy(row+i,&current,cfg.channels);
+            run--;
+            continue;
+        }
+        
+        //Remember where this codeword starts in case it is cut off
+        start = pos;
+        saved = current;
+        savedcbyte = cbyte;
+        savedrgbrun = rgbrun;
+        
+        if (rgbrun) {
+            //Next gray level of a raw block
+            rgbrun--;
+            QOIG_READ(&current.red,1);
+        } else {
+            QOIG_READ(&cbyte,1);
+            j = cbyte&OP_ARGS;
+            switch (cbyte&OP_CODE) {
+                case OP_INDEX:
+                    if (cfg.rawblocks && j == 63) {
+                        QOIG_READ(&rgbrun,1);
+                        QOIG_READ(&current.red,1);
                     } else {
-                        run = cbyte&OP_ARGS;
+                        current = cache[j];
+                    }
+                    break;
+                case OP_LUMA:
+                    QOIG_READ(&m,1);
+                    current.green += m;
+                case OP_DIFF:
+                    current.red += j-32;
+                    break;
+                case OP_RUN:
+                    if (cbyte == OP_RGB) {
+                        QOIG_READ(&current.red,1);
+                    } else if (cbyte == OP_RGBA) {
+                        QOIG_READ(&current,2);
+                    } else {
+                        run = j;
                         if (cfg.longruns&&run==61) {
-                            QOIG_READ(&cbyte,1,1,infile);
+                            QOIG_READ(&cbyte,1);
+                            if (cbyte < 128) {
+                                run+=cbyte;
+                            } else {
+                                QOIG_READ(&m,1);
+                                run+=(((cbyte&0x7F)<<8)+m+128);
+                            }
+                        }
+                    }
+            }
+        }
+        
+        memcpy(row+i,&current,cfg.channels);
+        QOIG_TRACE(d,i,in+start,pos-start,savedrgbrun,run);
+        if (clen) cache[HASH(current,clen)] = current;
+    }
+    if (0) {
+        //Input ended partway through a codeword. Back out of it.
+        more:
+        pos = start;
+        current = saved;
+        cbyte = savedcbyte;
+        rgbrun = savedrgbrun;
+        run = 0;
+    }
+    d->current = current;
+    d->cbyte = cbyte;
+    d->rgbrun = rgbrun;
+    d->run = run;
+    d->x = i;
+    return pos;
+}
+
+//Decode pixels into the current row until it is full or the input runs out.
+//Only whole codewords are consumed; returns the number of bytes used.
+static size_t qoig_decode_span(qoig_decoder *d, const uint8_t *in, size_t inlen) {
+    qoig_cfg cfg = d->cfg;
+    color *cache = d->cache;
+    color *longcache1 = d->longcache1;
+    color *longcache2 = d->longcache2;
+    color *bigcache = d->bigcache;
+    color current = d->current;
+    //What goes in the row: current put back through the color transform
+    color out = cfg.xform ? qoig_unxform(current) : current;
+    color temp,saved;
+    uint8_t cbyte = d->cbyte;
+    uint8_t rgbrun = d->rgbrun;
+    uint8_t savedcbyte,savedrgbrun;
+    size_t i;
+    size_t pos = 0, start = 0;
+    char j;
+    uint8_t m;
+    uint32_t run = d->run;
+    uint8_t *row = d->row;
+    int clen = d->clen;
+    uint8_t frozen = d->frozen;
+    
+    if (cfg.channels < 3) return qoig_decode_gray_span(d,in,inlen);
+    for (i=d->x;i<d->rowlen;i+=cfg.channels) {
+        j=0;
+        //Add another pixel for current run
+        if (run) {
+            memcpy(row+i,&out,cfg.channels);
+            run--;
+            continue;
+        }
+        
+        //Remember where this codeword starts in case it is cut off
+        start = pos;
+        saved = current;
+        savedcbyte = cbyte;
+        savedrgbrun = rgbrun;
+        
+        //Fetch next byte
+        if (rgbrun) {
+            rgbrun--;
+        } else {
+            QOIG_READ(&cbyte,1);
+        }
+
+        //Decode next codeword
+        switch (cbyte&OP_CODE) {
+
+            case OP_INDEX:
+                j = cbyte&OP_INDEX_ARG;
+                if (cfg.longindex && j>61) {
+                    QOIG_READ(&cbyte,1);
+                    if (j==62) {
+                        current = longcache1[cbyte];
+                        break;
+                    } else {
+                        current = longcache2[cbyte];
+                    }
+                    
+                } else if (cfg.bigcache && j >= QOIG_NEAREND(cfg)) {
+                    QOIG_READ(&cbyte,1);
+                    current = bigcache[((j-QOIG_NEAREND(cfg))<<8|cbyte)&(1<<cfg.bigcache)-1];
+                    break;
+                } else {
+                    current = cache[j];
+                    if (j<clen) break;
+                }
+                //What follows an index is a diff even if it looks like OP_RGBRUN,
+                //which it can after index 0 (with a cache length of 0)
+                j = 1;
+                QOIG_READ(&cbyte,1);
+
+            case OP_LUMA:
+                if ((cbyte&OP_CODE) == OP_LUMA) {
+                    j = (cbyte&OP_LUMA_ARG)-32;
+                    QOIG_READ(&cbyte,1);
+                    current.green += j;
+                    current.red += j+(LRS(cbyte,4)&0xF)-8;
+                    current.blue += j+(cbyte&0xF)-8;
+                    break;
+                }
+            case OP_DIFF:
+                if (cfg.rawblocks && !j && cbyte == OP_RGBRUN) {
+                    QOIG_READ(&rgbrun,1);
+                    cbyte = OP_RGB + LRS(rgbrun,7);
+                    rgbrun = (rgbrun&0x7F)+1;
+                } else {
+                    current.red += (LRS(cbyte,4)&3)-2;
+                    current.green += (LRS(cbyte,2)&3)-2;
+                    current.blue += (cbyte&3)-2;
+                    break;
+                }
+
+
+
+            case OP_RUN:
+                if (cbyte == OP_RGB || cbyte == OP_RGBA) {
+                    QOIG_READ(&current,3+(cbyte == OP_RGBA));
+                    if (QOIG_NEAREND(cfg)-clen) {
+                        if (cfg.longindex) {
+                            temp = cache[LOCALHASH(current,clen,QOIG_NEAREND(cfg))];
+                            if (!EQCOLOR(temp,current)) {
+                                longcache2[LOCALHASH(temp,0,256)] = temp;
+                            }
+                        }
+                        cache[LOCALHASH(current,clen,QOIG_NEAREND(cfg))] = current;
+                    }
+                } else if (cfg.alpha && cbyte == OP_ALPHA) {
+                    QOIG_READ(&current.alpha,1);
+                } else if (cfg.alpha && cbyte == OP_ALPHADIFF) {
+                    QOIG_READ(&m,1);
+                    current.red += (LRS(m,6)&3)-2;
+                    current.green += (LRS(m,4)&3)-2;
+                    current.blue += (LRS(m,2)&3)-2;
+                    current.alpha += (m&3)-2;
+                } else {
+                    run = cbyte&OP_ARGS;
+                    if (run==61) {
+                        run -= 2*cfg.alpha;
+                        if (cfg.longruns) {
+                            QOIG_READ(&cbyte,1);
                             if (cbyte < 128) {
                                 run+=cbyte;
                             } else {
-                                QOIG_READ(&m,1,1,infile);
+                                QOIG_READ(&m,1);
                                 run+=(((cbyte&0x7F)<<8)+m+128);
                             }
                         }
                     }
+                }
+        }
+            
+        out = cfg.xform ? qoig_unxform(current) : current;
+        memcpy(row+i,&out,cfg.channels);
+        QOIG_TRACE(d,i,in+start,pos-start,savedrgbrun,run);
+        if (clen) {
+            if (cfg.longindex && !frozen) {
+                temp = cache[HASH(current,clen)];
+                if (!EQCOLOR(temp,current)) {
+                    longcache1[LHASH(temp)] = temp;
+                }
             }
-                
-            memcpy(row+i,&current,cfg.channels);
-            if (clen) {
-                if (cfg.longindex) {
-                    temp = cache[HASH(current,clen)];
-                    if (!EQCOLOR(temp,current)) {
-                        longcache1[LHASH(temp)] = temp;
-                    }
+            cache[HASH(current,clen)] = current;
+        }
+        if (cfg.bigcache) bigcache[BIGHASH(current,cfg.bigcache)] = current;
+    }
+    if (0) {
+        //Input ended partway through a codeword. Back out of it.
+        more:
+        pos = start;
+        current = saved;
+        cbyte = savedcbyte;
+        rgbrun = savedrgbrun;
+        run = 0;
+    }
+    d->current = current;
+    d->cbyte = cbyte;
+    d->rgbrun = rgbrun;
+    d->run = run;
+    d->x = i;
+    return pos;
+}
+
+//Run byte codes through the decoder until a row is done or the input is used up
+static int qoig_decoder_feed(qoig_decoder *d, const uint8_t **in, size_t *len) {
+    size_t k, take;
+    
+    if (d->x == d->rowlen) d->x = 0;
+    while (1) {
+        if (d->npending) {
+            //Finish a codeword split across calls
+            take = sizeof(d->pending)-d->npending < *len ? sizeof(d->pending)-d->npending : *len;
+            memcpy(d->pending+d->npending,*in,take);
+            k = qoig_decode_span(d,d->pending,d->npending+take);
+            if (k >= d->npending) {
+                *in += k-d->npending;
+                *len -= k-d->npending;
+                d->npending = 0;
+                if (d->x != d->rowlen) continue;
+            } else {
+                memmove(d->pending,d->pending+k,d->npending+take-k);
+                d->npending -= k;
+                if (d->x != d->rowlen) {
+                    //Still not a whole codeword, so everything we were given is pending
+                    d->npending += take;
+                    *in += take;
+                    *len -= take;
+                    return QOIG_MORE;
                 }
-                cache[HASH(current,clen)] = current;
             }
-            *outlen += cfg.channels;
+        } else {
+            k = qoig_decode_span(d,*in,*len);
+            *in += k;
+            *len -= k;
+        }
+        if (d->x == d->rowlen) {
+            if (++d->y == d->desc.height) d->state = 2;
+            return QOIG_ROW;
+        }
+        if (!d->npending) {
+            //Keep the start of a codeword that was cut off
+            memcpy(d->pending,*in,*len);
+            d->npending = *len;
+            *in += *len;
+            *len = 0;
+            return QOIG_MORE;
+        }
+    }
+}
+
+//Collect the next entropy coded block and unpack it into plain.
+//Returns 1 once a block is ready, 0 if more input is needed, or -1 for a bad block.
+static int qoig_decoder_block(qoig_decoder *d, const uint8_t **in, size_t *len) {
+    size_t take, n, size;
+    
+    while (1) {
+        take = d->blkneed-d->blkhave < *len ? d->blkneed-d->blkhave : *len;
+        memcpy(d->blk+d->blkhave,*in,take);
+        d->blkhave += take;
+        *in += take;
+        *len -= take;
+        if (d->blkhave < d->blkneed) return 0;
+        n = d->blk[0]<<8|d->blk[1];
+        if (d->blkhave == 2) {
+            //Only asked for a block when rows are still missing, so the end marker is an error here
+            if (!n || n>QOIG_BLOCK) return -1;
+            d->blkneed = 3;
+        } else if (d->blkhave == 3) {
+            if (d->blk[2] > 1) return -1;
+            d->blkneed = d->blk[2] ? 133 : 3+n;
+        } else if (d->blk[2] && d->blkhave == 133) {
+            size = d->blk[131]<<8|d->blk[132];
+            if (!size || size >= n) return -1;
+            d->blkneed = 133+size;
+        } else {
+            if (d->blk[2]) {
+                if (qoig_huff_decode(d->blk+3,d->blk+133,d->blkhave-133,d->plain,n)) return -1;
+            } else {
+                memcpy(d->plain,d->blk+3,n);
+            }
+            d->plainlen = n;
+            d->plainpos = 0;
+            d->blkhave = 0;
+            d->blkneed = 2;
+            return 1;
+        }
+    }
+}
+
+//Collect the seed block after the header and load the caches from it.
+//Returns 1 once done, 0 if more input is needed, or -1 for a bad block
+//or a dictionary other than the one given to the decoder.
+static int qoig_decoder_seed(qoig_decoder *d, const uint8_t **in, size_t *len) {
+    qoig_seed seed;
+    size_t take;
+    uint32_t id;
+    int i;
+    
+    while (1) {
+        take = d->extneed-d->exthave < *len ? d->extneed-d->exthave : *len;
+        memcpy(d->ext+d->exthave,*in,take);
+        d->exthave += take;
+        *in += take;
+        *len -= take;
+        if (d->exthave < d->extneed) return 0;
+        if (d->exthave > 2) break;
+        if (d->ext[0] == QOIG_SEED_PALETTE && d->cfg.longindex) {
+            d->extneed = 2+(d->ext[1]+1)*d->desc.channels;
+        } else if (d->ext[0] == QOIG_SEED_DICT && d->cfg.channels > 2) {
+            d->extneed = 5;
+        } else {
+            return -1;
+        }
+    }
+    if (d->ext[0] == QOIG_SEED_DICT) {
+        memcpy(&id,d->ext+1,4);
+        if (!d->dict || d->dict->id != ntohl(id)) return -1;
+        qoig_dict_caches(d->cache,d->longcache1,d->longcache2,d->clen,d->cfg,d->dict);
+        return 1;
+    }
+    d->frozen = 1;
+    seed.n = d->ext[1]+1;
+    for (i=0;i<seed.n;i++) {
+        seed.colors[i] = (color){.alpha=255};
+        memcpy(&seed.colors[i],d->ext+2+i*d->desc.channels,d->desc.channels);
+    }
+    qoig_seed_caches(d->longcache1,d->longcache2,&seed,d->cfg.xform);
+    return 1;
+}
+
+//qoig_decoder_push without the checksums
+static int qoig_decoder_run(qoig_decoder *d, const uint8_t **in, size_t *len) {
+    const uint8_t *plain;
+    size_t take, n;
+    int ret;
+    
+    if (d->state == 0) {
+        take = 14-d->npending < *len ? 14-d->npending : *len;
+        memcpy(d->pending+d->npending,*in,take);
+        d->npending += take;
+        *in += take;
+        *len -= take;
+        if (d->npending < 14) return QOIG_MORE;
+        d->npending = 0;
+        if (qoig_decoder_header(d,d->pending)) return -1;
+        d->state = d->desc.colorspace&QOIG_EXT_MORE ? 5 : 4;
+    }
+    if (d->state == 5) {
+        //More extension flags, right after the header
+        if (!*len) return QOIG_MORE;
+        if (**in&~QOIG_EXT2_KNOWN) return -1;
+        d->cfg.xform = !!(**in&QOIG_EXT2_XFORM);
+        *in += 1;
+        *len -= 1;
+        if (d->cfg.xform && d->cfg.channels < 3) return -1;
+        d->state = 4;
+    }
+    if (d->state == 4) {
+        //Size of the big cache
+        if (d->desc.colorspace&QOIG_EXT_BIGCACHE) {
+            if (!*len) return QOIG_MORE;
+            d->cfg.bigcache = **in;
+            *in += 1;
+            *len -= 1;
+            if (d->cfg.bigcache < 7 || d->cfg.bigcache > 10 || d->clen > QOIG_NEAREND(d->cfg)) return -1;
+        }
+        if (d->desc.colorspace&QOIG_EXT_SEED) {
+            d->state = 3;
+            d->extneed = 2;
+        } else {
+            d->state = d->desc.height && d->desc.width ? 1 : 2;
+            return QOIG_HEADER;
+        }
+    }
+    if (d->state == 3) {
+        ret = qoig_decoder_seed(d,in,len);
+        if (ret <= 0) return ret ? -1 : QOIG_MORE;
+        d->state = d->desc.height && d->desc.width ? 1 : 2;
+        return QOIG_HEADER;
+    }
+    if (d->state == 2) return QOIG_DONE;
+    if (!d->cfg.entropy) return qoig_decoder_feed(d,in,len);
+    while (1) {
+        if (d->plainpos < d->plainlen) {
+            plain = d->plain+d->plainpos;
+            n = d->plainlen-d->plainpos;
+            ret = qoig_decoder_feed(d,&plain,&n);
+            d->plainpos = d->plainlen-n;
+            if (ret != QOIG_MORE) return ret;
+        }
+        ret = qoig_decoder_block(d,in,len);
+        if (ret <= 0) return ret ? -1 : QOIG_MORE;
+    }
+}
+
+//Checksum input as the decoder takes it, checking each chunk once it is complete
+static int qoig_decoder_check(qoig_decoder *d, const uint8_t *p, size_t n) {
+    size_t take, chunk;
+    uint32_t want;
+    
+    if (n > d->streamlen-d->checked) return -1;
+    while (n) {
+        take = QOIG_CRC_CHUNK-d->checked%QOIG_CRC_CHUNK < n ? QOIG_CRC_CHUNK-d->checked%QOIG_CRC_CHUNK : n;
+        d->crc = qoig_crc32c(d->crc,p,take);
+        d->checked += take;
+        p += take;
+        n -= take;
+        if (d->checked%QOIG_CRC_CHUNK == 0 || d->checked == d->streamlen) {
+            chunk = (d->checked-1)/QOIG_CRC_CHUNK;
+            memcpy(&want,d->crcs+4*chunk,4);
+            if (d->crc != ntohl(want)) return -1;
+            d->crc = 0;
+        }
+    }
+    return 0;
+}
+
+/*Feed input to a decoder. Consumes bytes from *in and returns
+    QOIG_HEADER once the file header has been read and desc and cfg are set,
+    QOIG_ROW    each time a row is complete (see qoig_decoder_row),
+    QOIG_MORE   when all input has been taken and more is needed,
+    QOIG_DONE   after the last row (remaining input is left alone),
+  or -1 if the stream is not a valid QOIG file. Call again with whatever
+  input remains after anything but QOIG_MORE or an error. A decoder given
+  the checksums with qoig_decoder_verify also fails on the first chunk that
+  doesn't match, and reads on to the end of the stream before QOIG_DONE.*/
+int qoig_decoder_push(qoig_decoder *d, const uint8_t **in, size_t *len) {
+    const uint8_t *start = *in;
+    size_t take;
+    int ret = qoig_decoder_run(d,in,len);
+    
+    if (!d->crcs || ret < 0) return ret;
+    if (qoig_decoder_check(d,start,*in-start)) return -1;
+    if (ret == QOIG_DONE && d->checked < d->streamlen) {
+        //The footer (or end marker) after the last row is checksummed too
+        take = d->streamlen-d->checked < *len ? d->streamlen-d->checked : *len;
+        if (qoig_decoder_check(d,*in,take)) return -1;
+        *in += take;
+        *len -= take;
+        if (d->checked < d->streamlen) return QOIG_MORE;
+    }
+    return ret;
+}
+
+//Have a decoder check the stream against the chunk CRCs of its trailer
+//(see qoig_crc_trailer). Call before pushing any input.
+void qoig_decoder_verify(qoig_decoder *d, const uint8_t *crcs, size_t streamlen) {
+    d->crcs = crcs;
+    d->streamlen = streamlen;
+}
+
+//Decode a whole QOIG stream in memory, passing the part of each row in view
+//to spng. Decoding stops at the bottom of the view, unless there are
+//checksums to check to the end.
+int qoig_decode(qoig_decoder *d, const uint8_t *in, size_t inlen, spng_ctx *ctx, qoig_view view, size_t *outlen) {
+    qoig_shrink shrink;
+    const uint8_t *px;
+    int ret;
+    int pret = 0;
+    
+    *outlen = 0;
+    if (qoig_view_fit(&view,d->desc.width,d->desc.height) || qoig_shrink_init(&shrink,view,d->desc.channels)) return -1;
+    while ((ret = qoig_decoder_push(d,&in,&inlen)) == QOIG_ROW) {
+        if ((px = qoig_shrink_row(&shrink,qoig_decoder_row(d),d->y-1))) {
+            pret = spng_encode_row(ctx,px,shrink.width*shrink.bpp);
+            if (pret && pret != SPNG_EOI) break;
+            *outlen += shrink.width*shrink.bpp;
+        }
+        //Rows below the view can be skipped, unless the checksums still
+        //have to be checked up to the end
+        if (d->y == view.y+view.height && d->y < d->desc.height && !d->crcs) {
+            ret = QOIG_DONE;
+            break;
+        }
+    }
+    qoig_shrink_free(&shrink);
+    //If we make it here without reaching the last row, we're missing
+    //part of the bytestream, so there is probably something wrong with the file.
+    return pret && pret != SPNG_EOI || ret != QOIG_DONE;
+}
+
+
+//Number of pixels a simulated encode looks at before giving up
+size_t qoig_sample_size(size_t pixels) {
+    size_t cap = 4*pixels/10;
+    return cap < 10000 ? 10000 : cap;
+}
+
+//Pick the format spng should decode a PNG to and return the number of channels
+//it will have in a QOIG file. Gray images stay gray if allowed: spng only 
+//expands gray of up to 8 bits (G8/GA8, with tRNS turned into alpha) and passes
+//8 bit gray+alpha through as is. Everything else is decoded to RGBA.
+static int qoig_png_format(spng_ctx *ctx, const struct spng_ihdr *ihdr, int gray, int *fmt, int *flags) {
+    struct spng_trns trns;
+    
+    *fmt = SPNG_FMT_RGBA8;
+    *flags = SPNG_DECODE_PROGRESSIVE;
+    if (gray && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8) {
+        if (spng_get_trns(ctx, &trns)) {
+            *fmt = SPNG_FMT_G8;
+            return 1;
+        }
+        *fmt = SPNG_FMT_GA8;
+        *flags |= SPNG_DECODE_TRNS;
+        return 2;
+    }
+    if (gray && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA && ihdr->bit_depth == 8) {
+        *fmt = SPNG_FMT_PNG;
+        return 2;
+    }
+    return 3+(ihdr->color_type>>2&1);
+}
+
+//Fill desc from a PNG header without decoding any image data. With gray set,
+//gray images have the 1 or 2 channels qoig_write keeps them in.
+int qoig_png_desc(const char *infile, qoig_desc *desc, int gray) {
+    FILE *inf = fopen(infile,"rb");
+    spng_ctx *ctx;
+    struct spng_ihdr ihdr;
+    int ret, fmt, flags;
+    
+    if (!inf) return -1;
+    ctx = spng_ctx_new(0);
+    if (!ctx) {
+        fclose(inf);
+        return -1;
+    }
+    spng_set_png_file(ctx, inf);
+    ret = spng_get_ihdr(ctx, &ihdr);
+    if (!ret) {
+        desc->width = ihdr.width;
+        desc->height = ihdr.height;
+        desc->channels = qoig_png_format(ctx, &ihdr, gray, &fmt, &flags);
+        desc->colorspace = QOIG_SRBG;
+    }
+    spng_ctx_free(ctx);
+    fclose(inf);
+    return ret ? -1 : 0;
+}
+
+//Fill desc from a QOI or QOIG header
+int qoig_qog_desc(const char *infile, qoig_desc *desc) {
+    FILE *inf = fopen(infile,"rb");
+    uint8_t header[14];
+    int ret;
+    
+    if (!inf) return -1;
+    ret = fread(header,1,14,inf) != 14 || memcmp(header,"qoi",3);
+    if (!ret) {
+        memcpy(&desc->width,header+4,4);
+        memcpy(&desc->height,header+8,4);
+        desc->width = ntohl(desc->width);
+        desc->height = ntohl(desc->height);
+        desc->channels = header[12];
+        desc->colorspace = header[13]&QOIG_COLORSPACE;
+    }
+    fclose(inf);
+    return ret ? -1 : 0;
+}
+
+typedef struct {
+    color c;
+    uint32_t n;
+} qoig_bin;
+
+static int qoig_bin_cmp(const void *a, const void *b) {
+    const qoig_bin *x = a, *y = b;
+    
+    if (x->n != y->n) return x->n < y->n ? 1 : -1;
+    return x->c.rgba < y->c.rgba ? -1 : x->c.rgba > y->c.rgba;
+}
+
+//Count the colors of a PNG into hist, a table of bins entries (a power of two
+//up to 65536) that may already hold counts from other images. A run costs one 
+//code however long it is, so only changes of color are counted. New colors are 
+//turned away once the table is three quarters full.
+int qoig_png_histogram(const char *infile, qoig_bin *hist, size_t bins, size_t *used) {
+    qoig_buf inf;
+    spng_ctx *ctx = spng_ctx_new(0);
+    struct spng_ihdr ihdr;
+    color *row = NULL;
+    const color *px;
+    color last;
+    uint8_t *img = NULL;
+    size_t x, imglen;
+    uint32_t y, h;
+    int ret = -1;
+    
+    qoig_map(infile,&inf);
+    if (!ctx || !inf.data) goto done;
+    spng_set_png_buffer(ctx, inf.data, inf.len);
+    if (spng_get_ihdr(ctx, &ihdr) || !(row = malloc(4*(size_t)ihdr.width+1)) ||
+        spng_decode_image(ctx, NULL, 0, SPNG_FMT_RGBA8, SPNG_DECODE_PROGRESSIVE) ||
+        qoig_deinterlace(ctx,4*(size_t)ihdr.width,ihdr.height,(uint8_t *)row,&img,&imglen)) goto done;
+    for (y=0;y<ihdr.height;y++) {
+        if (img) {
+            px = (const color *)(img+4*(size_t)ihdr.width*y);
+        } else {
+            ret = spng_decode_row(ctx, row, 4*(size_t)ihdr.width);
+            if (ret && ret != SPNG_EOI) {
+                ret = -1;
+                goto done;
+            }
+            px = row;
+        }
+        last.rgba = ~px[0].rgba;
+        for (x=0;x<ihdr.width;x++) {
+            if (EQCOLOR(px[x],last)) continue;
+            last = px[x];
+            h = (uint32_t)(last.rgba*2654435761u)>>16&bins-1;
+            while (hist[h].n && !EQCOLOR(hist[h].c,last)) h = h+1&bins-1;
+            if (!hist[h].n) {
+                if (4 * *used >= 3*bins) continue;
+                hist[h].c = last;
+                ++*used;
+            }
+            hist[h].n++;
+        }
+    }
+    ret = 0;
+    done:
+        if (img) munmap(img,imglen);
+        free(row);
+        qoig_unmap(&inf);
+        spng_ctx_free(ctx);
+        return ret;
+}
+
+//Pick seed colors for the secondary caches: the palette of an indexed PNG, or
+//else the most common colors of the image
+int qoig_png_seed(const char *infile, qoig_seed *seed) {
+    qoig_buf inf;
+    spng_ctx *ctx = spng_ctx_new(0);
+    struct spng_ihdr ihdr;
+    struct spng_plte plte;
+    qoig_bin *hist = NULL;
+    size_t used = 0;
+    int i, ret = -1;
+    
+    seed->n = 0;
+    qoig_map(infile,&inf);
+    if (!ctx || !inf.data) goto done;
+    spng_set_png_buffer(ctx, inf.data, inf.len);
+    if (spng_get_ihdr(ctx, &ihdr)) goto done;
+    if (ihdr.color_type == SPNG_COLOR_TYPE_INDEXED && !spng_get_plte(ctx, &plte)) {
+        //Without SPNG_DECODE_TRNS pixels of indexed images come out opaque
+        for (i=0;i<plte.n_entries;i++) {
+            seed->colors[i] = (color){.red=plte.entries[i].red,.green=plte.entries[i].green,
+                                      .blue=plte.entries[i].blue,.alpha=255};
         }
+        seed->n = plte.n_entries;
+        ret = 0;
+        goto done;
+    }
+    
+    hist = calloc(QOIG_HIST,sizeof(qoig_bin));
+    if (!hist || qoig_png_histogram(infile,hist,QOIG_HIST,&used)) goto done;
+    qsort(hist,QOIG_HIST,sizeof(qoig_bin),qoig_bin_cmp);
+    for (i=0;i<256 && hist[i].n;i++) {
+        seed->colors[i] = hist[i].c;
+    }
+    seed->n = i;
+    ret = 0;
+    done:
+        free(hist);
+        qoig_unmap(&inf);
+        spng_ctx_free(ctx);
+        return ret;
+}
+
+//Read a dictionary file written by qoigtrain
+int qoig_dict_load(const char *path, qoig_dict *dict) {
+    qoig_buf buf;
     
-        ret = spng_encode_row(ctx,row,cfg.channels*width);
-        rows_read++;
-    } while (!ret);
-    //If we make it here, we're missing an end of bytestream code,
-    //so there is probably something wrong with the file.
-    return !(ret==SPNG_EOI);
+    if (qoig_map(path,&buf)) return -1;
+    if (buf.len != QOIG_DICT_SIZE || memcmp(buf.data,"qogd",4)) {
+        qoig_unmap(&buf);
+        return -1;
+    }
+    memcpy(&dict->id,buf.data+4,4);
+    dict->id = ntohl(dict->id);
+    memcpy(dict->cache,buf.data+8,64*sizeof(color));
+    memcpy(dict->longcache1,buf.data+8+64*sizeof(color),256*sizeof(color));
+    memcpy(dict->longcache2,buf.data+8+320*sizeof(color),256*sizeof(color));
+    qoig_unmap(&buf);
+    return 0;
+}
+
+int qoig_dict_save(const char *path, const qoig_dict *dict) {
+    FILE *f = fopen(path,"wb");
+    uint32_t id = htonl(dict->id);
+    int ret;
+    
+    if (!f) return -1;
+    ret = fwrite("qogd",1,4,f) != 4 || fwrite(&id,4,1,f) != 1 ||
+          fwrite(dict->cache,sizeof(color),64,f) != 64 ||
+          fwrite(dict->longcache1,sizeof(color),256,f) != 256 ||
+          fwrite(dict->longcache2,sizeof(color),256,f) != 256;
+    return fclose(f) || ret ? -1 : 0;
 }
 
+//Give a decoder the dictionary that files using one were encoded with
+void qoig_decoder_dict(qoig_decoder *d, const qoig_dict *dict) {
+    d->dict = dict;
+}
 
 size_t qoig_write(const char *infile, const char *outfile, qoig_cfg cfg) {
-    FILE *inf;
-	FILE *outf;
+    qoig_buf inf;
+	FILE *outf = NULL;
 	size_t size, width;
     size_t byte_len;
     size_t limit = 1024 * 1024 * 64;
 	char *encoded = NULL;
-    uint32_t temp;
-    int fmt = SPNG_FMT_RGBA8;
+    int fmt, flags;
     qoig_desc desc;
-    spng_ctx *ctx;
+    spng_ctx *ctx = NULL;
+    qoig_encoder *e = NULL;
     
-    inf = fopen(infile,"rb");
+    //Map the source so spng inflates straight out of the page cache.
+    //Repeated simulated passes over the same file then cost no extra reads.
+    qoig_map(infile,&inf);
     
 	if (!cfg.simulate) {
         outf = fopen(outfile,"wb");
     }
-    if (!inf||!outf&&!cfg.simulate) {
+    if (!inf.data||!outf&&!cfg.simulate) {
 		goto error;
 	}
 
@@ -806,117 +3316,186 @@ size_t qoig_write(const char *infile, const char *outfile, qoig_cfg cfg) {
     spng_set_chunk_limits(ctx, limit, limit);
 
     // Set source PNG
-    spng_set_png_file(ctx, inf);
+    spng_set_png_buffer(ctx, inf.data, inf.len);
 
     struct spng_ihdr ihdr;
 
-    if (spng_get_ihdr(ctx, &ihdr)||spng_decoded_image_size(ctx, fmt, &byte_len)||
-        spng_decode_image(ctx, NULL, 0, fmt, SPNG_DECODE_PROGRESSIVE)) {
+    if (spng_get_ihdr(ctx, &ihdr)) {
         goto error;
     }
     
-    if (cfg.simulate) {
-        cfg.bytecap = byte_len/10;
-        if (cfg.bytecap < 10000) cfg.bytecap = 10000;
+    //Construct description, sized to the part of the image kept
+    if (qoig_view_fit(&cfg.view,ihdr.width,ihdr.height)) {
+        goto error;
     }
+    desc.width = width = QOIG_SHRUNK(cfg.view.width,cfg.view.scale);
+    desc.height = QOIG_SHRUNK(cfg.view.height,cfg.view.scale);
+    desc.channels = qoig_png_format(ctx, &ihdr, cfg.gray, &fmt, &flags);
     
-    if (cfg.longindex && cfg.clen == 30) {
-        cfg.clen = 29;
+    if (spng_decoded_image_size(ctx, fmt, &byte_len)||spng_decode_image(ctx, NULL, 0, fmt, flags)) {
+        goto error;
     }
-
-    width = byte_len / (4*ihdr.height);
     
-    //Construct description
-    desc.width = width;
-    desc.height = ihdr.height;
-    desc.channels = 3+(ihdr.color_type>>2&1);
+    if (cfg.simulate && !cfg.bytecap) {
+        cfg.bytecap = qoig_sample_size((size_t)width*desc.height);
+    }
     //since we're just converting from png, probably safe to assume sRBG colorspace
     desc.colorspace = QOIG_SRBG;
-    cfg.channels = desc.channels;
     
-    if (!cfg.simulate) {
-        //Write file header
-        fprintf(outf,"qoi%c", (char)(cfg.longruns<<7|(!cfg.longindex)<<6|(!cfg.rawblocks)<<5|(cfg.clen^24)));
-        temp = htonl(desc.width);
-        fwrite(&temp, 1, 4, outf);
-        temp = htonl(desc.height);
-        fwrite(&temp, 1, 4, outf);
-        fprintf(outf,"%c%c", desc.channels, desc.colorspace);
-    }
-
-	if (qoig_encode(ctx, width, outf, &size, cfg)) {
+    e = qoig_encoder_new(desc, cfg);
+	if (!e || qoig_encode(ctx, e, outf, &size)) {
 		goto error;
 	}
     
-    if (!cfg.simulate) {
-        //I have no idea what the file footer is for.
-        //Only print 7 bytes because we printed 1 coming out of qoig_encode
-        fwrite("\0\0\0\0\0\0\1",1,7,outf);
-        fclose(outf);
+    if (!cfg.simulate && qoig_close(outf)) {
+        size = -1;
     }
-    fclose(inf);
-    
+    qoig_unmap(&inf);
+    qoig_encoder_free(e);
     spng_ctx_free(ctx);
 	
 	return size;
     error:
-        fclose(inf);
-        if (!cfg.simulate) fclose(outf);
+        qoig_unmap(&inf);
+        if (outf) fclose(outf);
+        qoig_encoder_free(e);
+        spng_ctx_free(ctx);
+        return -1;
+}
+
+
+//Move n bytes of a file down from offset src to offset dst < src
+static int qoig_move_down(int fd, size_t dst, size_t src, size_t n) {
+    uint8_t buf[65536];
+    ssize_t got;
+    
+    while (n) {
+        got = pread(fd, buf, n < sizeof(buf) ? n : sizeof(buf), src);
+        if (got <= 0 || pwrite(fd, buf, got, dst) != got) return -1;
+        src += got;
+        dst += got;
+        n -= got;
+    }
+    return 0;
+}
+
+//Add the rows of a PNG of the same width to the bottom of a QOIG file written
+//with a state trailer, coding them from where the file left off. Only the end
+//of the file is rewritten. Returns the new size of the file.
+size_t qoig_append(const char *qogfile, const char *pngfile, qoig_cfg cfg) {
+    qoig_buf inf = {0}, png;
+    FILE *f = NULL;
+    size_t size, keep, end = 0, byte_len;
+    size_t limit = 1024 * 1024 * 64;
+    int fmt, flags, channels, undo = 1;
+    long tail;
+    uint32_t height;
+    spng_ctx *ctx = NULL;
+    struct spng_ihdr ihdr;
+    qoig_encoder *e = NULL;
+    
+    qoig_map(pngfile,&png);
+    ctx = spng_ctx_new(0);
+    if (!png.data || !ctx) goto error;
+    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+    spng_set_chunk_limits(ctx, limit, limit);
+    spng_set_png_buffer(ctx, png.data, png.len);
+    if (spng_get_ihdr(ctx, &ihdr)) goto error;
+    
+    //Everything the encoder needs is copied out before the file changes
+    qoig_map(qogfile,&inf);
+    if (!inf.data || !(e = qoig_encoder_reopen(inf.data,inf.len,cfg,ihdr.height,&keep))) goto error;
+    memcpy(&height,inf.data+8,4);
+    height = htonl(ntohl(height)+ihdr.height);
+    end = inf.len;
+    qoig_unmap(&inf);
+    channels = qoig_png_format(ctx, &ihdr, e->desc.channels < 3, &fmt, &flags);
+    if (ihdr.width != e->desc.width || channels != e->desc.channels && !(channels == 3 && e->desc.channels == 4) ||
+        spng_decoded_image_size(ctx, fmt, &byte_len) || spng_decode_image(ctx, NULL, 0, fmt, flags)) goto error;
+    
+    //Code on after everything already in the file, so that until the new rows
+    //are all written a failed read or write leaves the old image as it was
+    f = fopen(qogfile,"r+b");
+    if (!f || fseek(f,end,SEEK_SET) || qoig_encode(ctx, e, f, &size) || fflush(f) || (tail = ftell(f)) < 0) goto error;
+    //Then move them down over the end of stream marker, footer, and trailers.
+    //This only overwrites space the file already has.
+    undo = 0;
+    if (qoig_move_down(fileno(f),keep,end,tail-end) || ftruncate(fileno(f),keep+tail-end)) goto error;
+    if (fseek(f,8,SEEK_SET) || fwrite(&height,1,4,f) != 4) goto error;
+    if (qoig_close(f)) size = -1;
+    qoig_unmap(&png);
+    qoig_encoder_free(e);
+    spng_ctx_free(ctx);
+    return size;
+    error:
+        qoig_unmap(&inf);
+        qoig_unmap(&png);
+        if (f) {
+            fclose(f);
+            //Drop whatever part of the new rows made it into the file
+            if (undo && truncate(qogfile,end)) {}
+        }
+        qoig_encoder_free(e);
         spng_ctx_free(ctx);
         return -1;
 }
 
+//Start decoding a mapped QOI or QOIG file, up to and including its header.
+//Checks the checksums on the way if it has any.
+static int qoig_decoder_open(qoig_decoder *d, const qoig_buf *inf, const qoig_dict *dict, const uint8_t **in, size_t *inlen) {
+    size_t streamlen;
+    
+    qoig_decoder_dict(d,dict);
+    if (inf->len >= 14 && inf->data[13]&QOIG_EXT_CRC) {
+        if (qoig_crc_trailer(inf->data,inf->len,&streamlen)) return -1;
+        qoig_decoder_verify(d,inf->data+streamlen,streamlen);
+    }
+    *in = inf->data;
+    *inlen = inf->len;
+    return qoig_decoder_push(d,in,inlen) == QOIG_HEADER ? 0 : -1;
+}
 
-size_t qoig_read(const char *infile, const char *outfile) {
-	FILE *inf = fopen(infile, "rb");
+size_t qoig_read(const char *infile, const char *outfile, const qoig_dict *dict, qoig_view view) {
+	qoig_buf inf;
     FILE *outf = fopen(outfile, "wb");
 	size_t size;
-    long bytes_read, px_len;
-    char magic[4];
+    const uint8_t *in;
+    size_t inlen;
     qoig_desc desc;
     struct spng_ihdr ihdr = {0};
-    spng_ctx *enc;
-    qoig_cfg cfg;
+    //PNG color type for each channel count
+    const uint8_t color_types[5] = {0,SPNG_COLOR_TYPE_GRAYSCALE,SPNG_COLOR_TYPE_GRAYSCALE_ALPHA,
+                                    SPNG_COLOR_TYPE_TRUECOLOR,SPNG_COLOR_TYPE_TRUECOLOR_ALPHA};
+    spng_ctx *enc = NULL;
+    qoig_decoder *d = NULL;
     int fmt;
 
-    if (!inf || !outf) {
+    qoig_map(infile,&inf);
+    if (!inf.data || !outf) {
         goto error;
     }
 
     enc = spng_ctx_new(SPNG_CTX_ENCODER);
+    d = qoig_decoder_new();
 
-    if (!enc) {
+    if (!enc || !d) {
         goto error;
     }
 
-
-	//Check magic string
-    if (fread(magic,1,4,inf)!=4||memcmp(magic,"qoi",3)) {
+    //Read the header
+    if (qoig_decoder_open(d,&inf,dict,&in,&inlen)) {
         goto error;
     }
-    
-    //Extract desc from header
-    if (fread(&desc, 1, 10, inf)!=10) {
+    desc = d->desc;
+    if (qoig_view_fit(&view,desc.width,desc.height)) {
         goto error;
     }
-    
-    //Create config
-    cfg.clen = (magic[3]&0x1F)^24;
-    cfg.longruns = magic[3]>>7;
-    cfg.longindex = !(magic[3]>>6&1);
-    cfg.rawblocks = !(magic[3]>>5&1);
-    cfg.channels = desc.channels;
-    
-
-    //Fix byte order on dimensions
-    desc.width = ntohl(desc.width);
-    desc.height = ntohl(desc.height);
 
     //Create PNG header
-    ihdr.width = desc.width;
-    ihdr.height = desc.height;
+    ihdr.width = QOIG_SHRUNK(view.width,view.scale);
+    ihdr.height = QOIG_SHRUNK(view.height,view.scale);
     ihdr.bit_depth = 8;
-    ihdr.color_type = 4*desc.channels-10;
+    ihdr.color_type = color_types[desc.channels];
     
     if (spng_set_ihdr(enc,&ihdr)) {
         goto error;
@@ -929,18 +3508,292 @@ size_t qoig_read(const char *infile, const char *outfile) {
     fmt = SPNG_FMT_PNG;
     
     
-	if (spng_encode_image(enc, 0, 0, fmt, SPNG_ENCODE_PROGRESSIVE)||qoig_decode(inf, desc.width, enc, &size, cfg)) {
+	if (spng_encode_image(enc, 0, 0, fmt, SPNG_ENCODE_PROGRESSIVE)||qoig_decode(d, in, inlen, enc, view, &size)) {
         goto error;
     }
     
-    fclose(inf);
-    fclose(outf);
+    qoig_unmap(&inf);
+    if (qoig_close(outf)) {
+        size = -1;
+    }
+    qoig_decoder_free(d);
     spng_ctx_free(enc);
 	return size;
 
     error:
-        fclose(inf);
-        fclose(outf);
+        qoig_unmap(&inf);
+        if (outf) fclose(outf);
+        qoig_decoder_free(d);
         spng_ctx_free(enc);
         return -1;
 }
+
+//Convert a QOI or QOIG file to QOI or QOIG with new settings. Rows go straight
+//from the decoder to the encoder, so no PNG is involved. The dictionary is for
+//decoding; the encoder uses the one in cfg.
+size_t qoig_transcode(const char *infile, const char *outfile, qoig_cfg cfg, const qoig_dict *dict) {
+    qoig_buf inf;
+    FILE *outf = NULL;
+    const uint8_t *in, *out, *src;
+    size_t inlen, len, n, x, size;
+    qoig_desc desc;
+    qoig_decoder *d = qoig_decoder_new();
+    qoig_encoder *e = NULL;
+    qoig_shrink shrink = {0};
+    color *row = NULL;
+    uint32_t oy = 0;
+    int ret;
+    
+    qoig_map(infile,&inf);
+    if (!cfg.simulate) {
+        outf = fopen(outfile,"wb");
+    }
+    if (!inf.data || !outf && !cfg.simulate || !d || qoig_decoder_open(d,&inf,dict,&in,&inlen)) {
+        goto error;
+    }
+    desc = d->desc;
+    desc.colorspace &= QOIG_COLORSPACE;
+    if (qoig_view_fit(&cfg.view,desc.width,desc.height) || qoig_shrink_init(&shrink,cfg.view,desc.channels)) {
+        goto error;
+    }
+    desc.width = shrink.width;
+    desc.height = QOIG_SHRUNK(cfg.view.height,cfg.view.scale);
+    //Gray stays gray if allowed, otherwise it is spread over RGB
+    if (desc.channels < 3 && !cfg.gray) {
+        desc.channels += 2;
+    }
+    if (cfg.simulate && !cfg.bytecap) {
+        cfg.bytecap = qoig_sample_size((size_t)desc.width*desc.height);
+    }
+    e = qoig_encoder_new(desc,cfg);
+    row = malloc(sizeof(color)*(desc.width ? desc.width : 1));
+    if (!e || !row) {
+        goto error;
+    }
+    
+    //Encode each row of the view as soon as it is decoded
+    while ((ret = qoig_decoder_push(d,&in,&inlen)) == QOIG_ROW) {
+        if (!(src = qoig_shrink_row(&shrink,qoig_decoder_row(d),d->y-1))) continue;
+        n = desc.width;
+        if (cfg.bytecap) {
+            if ((size_t)oy*desc.width >= cfg.bytecap) break;
+            if (cfg.bytecap-(size_t)oy*desc.width < n) n = cfg.bytecap-(size_t)oy*desc.width;
+        }
+        oy++;
+        if (desc.channels == d->desc.channels && desc.channels < 3) {
+            if (qoig_encoder_push_gray(e,src,n)) goto error;
+        } else {
+            for (x=0;x<n;x++) {
+                row[x] = (color){.alpha=255};
+                if (d->desc.channels < 3) {
+                    row[x].red = row[x].green = row[x].blue = src[x*d->desc.channels];
+                    if (d->desc.channels == 2) row[x].alpha = src[x*2+1];
+                } else {
+                    memcpy(&row[x],src+x*d->desc.channels,d->desc.channels);
+                }
+            }
+            if (qoig_encoder_push(e,row,n)) goto error;
+        }
+        out = qoig_encoder_output(e,&len);
+        if (!out || !cfg.simulate && fwrite(out,1,len,outf) != len) goto error;
+        if (d->y == cfg.view.y+cfg.view.height && d->y < d->desc.height && !d->crcs) break;
+    }
+    if (ret != QOIG_DONE && ret != QOIG_ROW || qoig_encoder_finish(e)) {
+        goto error;
+    }
+    out = qoig_encoder_output(e,&len);
+    if (!out || !cfg.simulate && fwrite(out,1,len,outf) != len) {
+        goto error;
+    }
+    size = e->ct;
+    
+    qoig_unmap(&inf);
+    if (outf && qoig_close(outf)) {
+        size = -1;
+    }
+    qoig_decoder_free(d);
+    qoig_encoder_free(e);
+    qoig_shrink_free(&shrink);
+    free(row);
+    return size;
+    error:
+        qoig_unmap(&inf);
+        if (outf) fclose(outf);
+        qoig_decoder_free(d);
+        qoig_encoder_free(e);
+        qoig_shrink_free(&shrink);
+        free(row);
+        return -1;
+}
+
+/*Decode a QOI or QOIG file and hash its pixels a row at a time with 
+  qoig_hash64, leaving the result in digest. Given the PNG it came from, that
+  is decoded in step the way qoig_write would and each row compared, without
+  writing anything out. Returns 0 if everything matches, 1 with badrow set to
+  the first row that differs, 2 if the PNG is a different size or would have 
+  other channels, or -1 if either file can't be read or decoded.*/
+int qoig_digest(const char *infile, const char *pngfile, const qoig_dict *dict, uint64_t *digest, uint32_t *badrow) {
+    qoig_buf inf, png = {0};
+    qoig_decoder *d = qoig_decoder_new();
+    spng_ctx *ctx = NULL;
+    struct spng_ihdr ihdr;
+    const uint8_t *in, *src;
+    uint8_t *img = NULL, *row = NULL;
+    size_t inlen, imglen;
+    uint64_t h = 0;
+    uint32_t y = 0;
+    int fmt, flags, ret = -1;
+    
+    qoig_map(infile,&inf);
+    if (!inf.data || !d || qoig_decoder_open(d,&inf,dict,&in,&inlen)) {
+        goto done;
+    }
+    if (pngfile) {
+        qoig_map(pngfile,&png);
+        ctx = spng_ctx_new(0);
+        if (!png.data || !ctx) {
+            goto done;
+        }
+        spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+        spng_set_chunk_limits(ctx, 1024 * 1024 * 64, 1024 * 1024 * 64);
+        spng_set_png_buffer(ctx, png.data, png.len);
+        if (spng_get_ihdr(ctx, &ihdr)) {
+            goto done;
+        }
+        if (ihdr.width != d->desc.width || ihdr.height != d->desc.height ||
+            qoig_png_format(ctx,&ihdr,d->desc.channels < 3,&fmt,&flags) != d->desc.channels) {
+            ret = 2;
+            goto done;
+        }
+        //Rows come out just as the decoder makes them
+        if (d->desc.channels == 3) {
+            fmt = SPNG_FMT_RGB8;
+        }
+        if (spng_decode_image(ctx, NULL, 0, fmt, flags) || !(row = malloc(d->rowlen+1)) ||
+            qoig_deinterlace(ctx,d->rowlen,ihdr.height,row,&img,&imglen)) {
+            goto done;
+        }
+    }
+    while ((ret = qoig_decoder_push(d,&in,&inlen)) == QOIG_ROW) {
+        h = qoig_hash64(h,qoig_decoder_row(d),d->rowlen);
+        if (ctx) {
+            if (img) {
+                src = img+(size_t)y*d->rowlen;
+            } else {
+                ret = spng_decode_row(ctx, row, d->rowlen);
+                if (ret && ret != SPNG_EOI) {
+                    ret = -1;
+                    goto done;
+                }
+                src = row;
+            }
+            if (memcmp(src,qoig_decoder_row(d),d->rowlen)) {
+                *badrow = y;
+                ret = 1;
+                goto done;
+            }
+        }
+        y++;
+    }
+    if (ret != QOIG_DONE) {
+        ret = -1;
+        goto done;
+    }
+    *digest = h;
+    ret = 0;
+    done:
+        if (img) munmap(img,imglen);
+        free(row);
+        spng_ctx_free(ctx);
+        qoig_unmap(&png);
+        qoig_unmap(&inf);
+        qoig_decoder_free(d);
+        return ret;
+}
+
+//Pixels a context spreads out into whole colors at a time for RGB input
+#define QOIG_CTX_PIECE 1024
+
+/*An encoder, a decoder and their buffers, kept from one image to the next.
+  For many small images (icons, thumbnails) in memory, where opening files,
+  setting up spng and allocating codec state would cost more than the pixels.
+  A new image only resets the codec state; buffers grow to fit the largest
+  image seen and are never given back until qoig_ctx_free.*/
+typedef struct {
+    qoig_encoder e;
+    qoig_decoder d;
+    color piece[QOIG_CTX_PIECE];
+    uint8_t *img;
+    size_t imgcap;
+} qoig_ctx;
+
+qoig_ctx *qoig_ctx_new() {
+    return calloc(1,sizeof(qoig_ctx));
+}
+
+void qoig_ctx_free(qoig_ctx *c) {
+    if (!c) return;
+    free(c->e.out);
+    free(c->e.ent);
+    free(c->e.crcs);
+    free(c->d.row);
+    free(c->d.blk);
+    free(c->d.plain);
+    free(c->img);
+    free(c);
+}
+
+//Encode an image held in memory as packed rows of desc.channels bytes per
+//pixel; 1 or 2 channels make a gray mode file. Returns the whole file, valid
+//until the next call with this context, or NULL if out of memory.
+const uint8_t *qoig_ctx_encode(qoig_ctx *c, const uint8_t *px, qoig_desc desc, qoig_cfg cfg, size_t *len) {
+    qoig_encoder *e = &c->e;
+    size_t n = (size_t)desc.width*desc.height;
+    size_t i, k, take;
+    
+    desc.colorspace &= QOIG_COLORSPACE;
+    if (desc.channels<1 || desc.channels>4 || qoig_encoder_init(e,desc,cfg)) return NULL;
+    if (desc.channels < 3) {
+        if (qoig_encoder_push_gray(e,px,n)) return NULL;
+    } else if (desc.channels == 4 && (uintptr_t)px%sizeof(color) == 0) {
+        if (qoig_encoder_push(e,(const color *)px,n)) return NULL;
+    } else {
+        for (i=0;i<n;i+=take) {
+            take = n-i < QOIG_CTX_PIECE ? n-i : QOIG_CTX_PIECE;
+            for (k=0;k<take;k++) {
+                c->piece[k] = (color){.alpha=255};
+                memcpy(&c->piece[k],px+(i+k)*desc.channels,desc.channels);
+            }
+            if (qoig_encoder_push(e,c->piece,take)) return NULL;
+        }
+    }
+    if (qoig_encoder_finish(e)) return NULL;
+    return qoig_encoder_output(e,len);
+}
+
+//Decode a QOI or QOIG file held in memory into packed rows of desc->channels
+//bytes per pixel, checking its checksums if it has any. Returns the pixels,
+//valid until the next call with this context, or NULL if the file is bad.
+const uint8_t *qoig_ctx_decode(qoig_ctx *c, const uint8_t *in, size_t len, const qoig_dict *dict, qoig_desc *desc) {
+    qoig_decoder *d = &c->d;
+    qoig_buf buf = {in,len,0};
+    uint8_t *p;
+    int ret;
+    
+    qoig_decoder_reset(d);
+    //The header is untrusted, so the image size must not wrap around
+    if (qoig_decoder_open(d,&buf,dict,&in,&len) ||
+        d->rowlen && d->desc.height > (SIZE_MAX-1)/d->rowlen ||
+        qoig_grow(&c->img,&c->imgcap,d->rowlen*d->desc.height+1)) {
+        return NULL;
+    }
+    p = c->img;
+    while ((ret = qoig_decoder_push(d,&in,&len)) == QOIG_ROW) {
+        memcpy(p,d->row,d->rowlen);
+        p += d->rowlen;
+    }
+    if (ret != QOIG_DONE) return NULL;
+    *desc = d->desc;
+    desc->colorspace &= QOIG_COLORSPACE;
+    return c->img;
+}
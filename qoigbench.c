@@ -0,0 +1,322 @@
+//Count the pixels each kind of codeword makes through the decoder's trace hook
+#define QOIG_TRACE(d,i,code,len,inraw,run) (counting ? count_op(d,code,inraw,run) : (void)0)
+static int counting;
+static void count_op(const void *dec, const unsigned char *code, int inraw, unsigned long run);
+#include "qoig.h"
+#include "miniz.h"
+#include <stdlib.h>
+#include <time.h>
+
+//Compare plain QOIG, QOIG with a big cache of 256 or 1024 colors, QOIG with
+//the color transform, QOIG+ (built in entropy coding), and QOIG followed by
+//deflate on ratio and in-memory encode/decode speed, and on the share of
+//pixels made by literal colors, diffs, lumas and indexes. With -s, time many small
+//images instead: tiles cut from each image, each its own file, coded with a new
+//encoder and decoder every time or through one reused qoig_ctx. A 1x1 image
+//shows the fixed cost per image.
+//Usage: qoigbench [-n runs] [-s size] image.png...
+
+typedef struct {
+    const char *name;
+    uint8_t entropy;
+    uint8_t deflate;
+    uint8_t bigcache;
+    uint8_t xform;
+} mode;
+
+#define NMODES 6
+static const mode modes[NMODES] = {
+    {"QOIG", 0, 0, 0, 0},
+    {"QOIG big256", 0, 0, 8, 0},
+    {"QOIG big1024", 0, 0, 10, 0},
+    {"QOIG xform", 0, 0, 0, 1},
+    {"QOIG+", 1, 0, 0, 0},
+    {"QOIG+deflate", 0, 1, 0, 0}
+};
+
+//Kinds of codeword counted. Runs are left over.
+enum { K_LITERAL, K_DIFF, K_LUMA, K_INDEX, K_KINDS };
+static unsigned long long pixels[K_KINDS];
+
+static void count_op(const void *dec, const unsigned char *code, int inraw, unsigned long run) {
+    const qoig_decoder *d = dec;
+    uint8_t b = code[0];
+    int kind;
+
+    if (inraw || b == OP_RGB || b == OP_RGBA || d->cfg.rawblocks && b == OP_RGBRUN) {
+        kind = K_LITERAL;
+    } else if ((b&OP_CODE) == OP_INDEX) {
+        kind = K_INDEX;
+    } else if ((b&OP_CODE) == OP_DIFF || d->cfg.alpha && (b == OP_ALPHA || b == OP_ALPHADIFF)) {
+        kind = K_DIFF;
+    } else if ((b&OP_CODE) == OP_LUMA) {
+        kind = K_LUMA;
+    } else {
+        return;
+    }
+    pixels[kind] += run+1;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+//Decode a whole PNG to RGBA
+static color *load_png(const char *path, qoig_desc *desc) {
+    qoig_buf buf;
+    spng_ctx *ctx = spng_ctx_new(0);
+    struct spng_ihdr ihdr;
+    size_t len;
+    color *px = NULL;
+
+    if (!ctx || qoig_map(path,&buf)) {
+        spng_ctx_free(ctx);
+        return NULL;
+    }
+    spng_set_png_buffer(ctx,buf.data,buf.len);
+    if (!spng_get_ihdr(ctx,&ihdr) && !spng_decoded_image_size(ctx,SPNG_FMT_RGBA8,&len) &&
+        (px = malloc(len)) && spng_decode_image(ctx,px,len,SPNG_FMT_RGBA8,0)) {
+        free(px);
+        px = NULL;
+    }
+    if (px) {
+        desc->width = ihdr.width;
+        desc->height = ihdr.height;
+        desc->channels = 3+(ihdr.color_type>>2&1);
+        desc->colorspace = QOIG_SRBG;
+    }
+    qoig_unmap(&buf);
+    spng_ctx_free(ctx);
+    return px;
+}
+
+//Encode to a buffer with room for the worst case
+static size_t encode(qoig_desc desc, qoig_cfg cfg, const color *px, uint8_t *dst) {
+    qoig_encoder *e = qoig_encoder_new(desc,cfg);
+    const uint8_t *out;
+    size_t len, n = 0;
+
+    if (!e || qoig_encoder_push(e,px,(size_t)desc.width*desc.height) ||
+        !(out = qoig_encoder_output(e,&len))) {
+        qoig_encoder_free(e);
+        return 0;
+    }
+    memcpy(dst,out,len);
+    n = len;
+    if (qoig_encoder_finish(e) || !(out = qoig_encoder_output(e,&len))) {
+        qoig_encoder_free(e);
+        return 0;
+    }
+    memcpy(dst+n,out,len);
+    qoig_encoder_free(e);
+    return n+len;
+}
+
+//Decode a buffer into packed rows. Returns nonzero on failure.
+static int decode(const uint8_t *in, size_t len, uint8_t *img) {
+    qoig_decoder *d = qoig_decoder_new();
+    int ret;
+
+    if (!d || qoig_decoder_push(d,&in,&len) != QOIG_HEADER) {
+        qoig_decoder_free(d);
+        return -1;
+    }
+    while ((ret = qoig_decoder_push(d,&in,&len)) == QOIG_ROW) {
+        memcpy(img,qoig_decoder_row(d),d->rowlen);
+        img += d->rowlen;
+    }
+    qoig_decoder_free(d);
+    return ret != QOIG_DONE;
+}
+
+//Encode and decode each of n tiles as a file of its own, either with a new
+//encoder and decoder every time or through c. Sets the best time per tile of runs.
+static int time_tiles(qoig_ctx *c, qoig_desc tdesc, qoig_cfg cfg, const color *tiles, const uint8_t *packed,
+                      size_t n, int runs, uint8_t *enc, size_t *lens, uint8_t *img, double *enctime, double *dectime) {
+    size_t tpx = (size_t)tdesc.width*tdesc.height;
+    size_t i, at, len;
+    const uint8_t *out;
+    qoig_desc desc;
+    double t;
+    int r;
+
+    *enctime = *dectime = 1e30;
+    for (r=0;r<runs;r++) {
+        t = now();
+        for (i=at=0;i<n;at+=lens[i++]) {
+            if (c) {
+                if (!(out = qoig_ctx_encode(c,packed+i*tpx*tdesc.channels,tdesc,cfg,&len))) return -1;
+                memcpy(enc+at,out,len);
+            } else if (!(len = encode(tdesc,cfg,tiles+i*tpx,enc+at))) {
+                return -1;
+            }
+            lens[i] = len;
+        }
+        t = now()-t;
+        if (t < *enctime) *enctime = t;
+
+        t = now();
+        for (i=at=0;i<n;at+=lens[i++]) {
+            if (c ? !qoig_ctx_decode(c,enc+at,lens[i],NULL,&desc) : decode(enc+at,lens[i],img)) return -1;
+        }
+        t = now()-t;
+        if (t < *dectime) *dectime = t;
+    }
+    *enctime /= n;
+    *dectime /= n;
+    return 0;
+}
+
+//Cut px into size x size tiles (or take its first pixel 4096 times for a size
+//of 1) and time both ways of coding them
+static void bench_tiles(const char *name, qoig_desc desc, qoig_cfg cfg, const color *px, uint32_t size, int runs) {
+    qoig_desc tdesc = desc;
+    size_t across = desc.width/size, n = size == 1 ? 4096 : across*(desc.height/size);
+    size_t tpx = (size_t)size*size, cap = tpx*6+QOIG_SLACK+14+2*(tpx*4/QOIG_BLOCK+2)*133;
+    size_t i, k;
+    color *tiles = malloc(n*tpx*sizeof(color)+1);
+    uint8_t *packed = malloc(n*tpx*desc.channels+1);
+    uint8_t *enc = malloc(n*cap+1);
+    uint8_t *img = malloc(tpx*4);
+    size_t *lens = malloc(n*sizeof(size_t)+1);
+    qoig_ctx *c = qoig_ctx_new();
+    double enctime, dectime;
+    char tile[24];
+    int reuse;
+
+    if (!n) {
+        printf("%-24s smaller than one %ux%u tile\n",name,size,size);
+    } else if (!tiles || !packed || !enc || !img || !lens || !c) {
+        printf("%-24s out of memory\n",name);
+        n = 0;
+    }
+    tdesc.width = tdesc.height = size;
+    for (i=0;i<n*tpx;i++) {
+        k = size == 1 ? 0 : (i/tpx/across*size+i%tpx/size)*desc.width+i/tpx%across*size+i%size;
+        tiles[i] = px[k];
+        memcpy(packed+i*desc.channels,&px[k],desc.channels);
+    }
+    snprintf(tile,sizeof(tile),"%ux%u",size,size);
+    for (reuse=0;reuse<2 && n;reuse++) {
+        if (time_tiles(reuse ? c : NULL,tdesc,cfg,tiles,packed,n,runs,enc,lens,img,&enctime,&dectime)) {
+            printf("%-24s %-10s %-10s failed\n",name,tile,reuse ? "qoig_ctx" : "new/free");
+            continue;
+        }
+        printf("%-24s %-10s %-10s %8zu %12.3f %12.3f\n",name,tile,reuse ? "qoig_ctx" : "new/free",n,
+               enctime*1e6,dectime*1e6);
+    }
+    free(tiles);
+    free(packed);
+    free(enc);
+    free(img);
+    free(lens);
+    qoig_ctx_free(c);
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    int tile = 0;
+    int i, m, r;
+    qoig_desc desc;
+    qoig_cfg cfg = {0};
+    color *px;
+    uint8_t *enc, *img, *def;
+    size_t raw, cap, len, size;
+    mz_ulong dlen, ulen;
+    double t, enctime, dectime, npx;
+
+    while (argc > 2 && (!strcmp(argv[1],"-n") || !strcmp(argv[1],"-s"))) {
+        if (argv[1][1] == 'n') {
+            runs = atoi(argv[2]);
+        } else {
+            tile = atoi(argv[2]);
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc < 2 || runs < 1 || tile < 0) {
+        fprintf(stderr,"Usage: qoigbench [-n runs] [-s size] image.png...\n");
+        return 1;
+    }
+    //Settings of qoigconv -f
+    cfg.clen = 26;
+    cfg.longruns = 1;
+    cfg.longindex = 1;
+    cfg.rawblocks = 1;
+    if (tile) {
+        printf("%-24s %-10s %-10s %8s %12s %12s\n","file","tile","setup","tiles","enc us/tile","dec us/tile");
+    } else {
+        printf("%-24s %-14s %10s %7s %10s %10s %6s %6s %6s %6s\n","file","mode","bytes","ratio","enc MB/s","dec MB/s",
+               "rgb%","diff%","luma%","index%");
+    }
+    for (i=1;i<argc;i++) {
+        px = load_png(argv[i],&desc);
+        if (!px) {
+            fprintf(stderr,"Could not read %s\n",argv[i]);
+            continue;
+        }
+        if (tile) {
+            bench_tiles(argv[i],desc,cfg,px,tile,runs);
+            bench_tiles(argv[i],desc,cfg,px,1,runs);
+            free(px);
+            continue;
+        }
+        raw = (size_t)desc.width*desc.height*desc.channels;
+        cap = (size_t)desc.width*desc.height*6+QOIG_SLACK+14+2*(raw/QOIG_BLOCK+2)*133;
+        enc = malloc(cap);
+        img = malloc(raw ? raw : 1);
+        def = malloc(mz_compressBound(cap));
+        if (!enc || !img || !def) return 1;
+        for (m=0;m<NMODES;m++) {
+            cfg.entropy = modes[m].entropy;
+            cfg.bigcache = modes[m].bigcache;
+            cfg.xform = modes[m].xform;
+            enctime = dectime = 1e30;
+            for (r=0;r<runs;r++) {
+                t = now();
+                len = encode(desc,cfg,px,enc);
+                size = len;
+                if (len && modes[m].deflate) {
+                    dlen = mz_compressBound(len);
+                    if (mz_compress2(def,&dlen,enc,len,MZ_DEFAULT_LEVEL) != MZ_OK) len = 0;
+                    size = dlen;
+                }
+                t = now()-t;
+                if (t < enctime) enctime = t;
+                if (!len) break;
+
+                t = now();
+                if (modes[m].deflate) {
+                    ulen = len;
+                    if (mz_uncompress(enc,&ulen,def,dlen) != MZ_OK) len = 0;
+                }
+                if (!len || decode(enc,len,img)) {
+                    len = 0;
+                    break;
+                }
+                t = now()-t;
+                if (t < dectime) dectime = t;
+            }
+            //One more decode, untimed, to count codewords
+            memset(pixels,0,sizeof(pixels));
+            counting = 1;
+            if (len && decode(enc,len,img)) len = 0;
+            counting = 0;
+            if (!len) {
+                printf("%-24s %-14s failed\n",argv[i],modes[m].name);
+                continue;
+            }
+            npx = (double)desc.width*desc.height/100;
+            printf("%-24s %-14s %10zu %6.2f%% %10.1f %10.1f %6.1f %6.1f %6.1f %6.1f\n",argv[i],modes[m].name,size,
+                   100.0*size/raw,raw/enctime/1e6,raw/dectime/1e6,pixels[K_LITERAL]/npx,pixels[K_DIFF]/npx,
+                   pixels[K_LUMA]/npx,pixels[K_INDEX]/npx);
+        }
+        free(px);
+        free(enc);
+        free(img);
+        free(def);
+    }
+    return 0;
+}
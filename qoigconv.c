@@ -2,6 +2,8 @@
 #include <argp.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
@@ -10,12 +12,26 @@ typedef struct {
 
 } params;
 
+//Settings for each effort level: clen, simnum, percent of the image each
+//simulation samples, longruns, longindex, rawblocks, search
+static const unsigned char efforts[9][7] = {
+    {30, 0,  0,0,0,0,0},
+    {26, 0,  0,1,0,0,0},
+    {26, 0,  0,1,1,1,0},
+    {26, 3,  5,1,1,1,0},
+    {26, 6, 10,1,1,1,0},
+    {26,10, 20,1,1,1,0},
+    {26,10, 40,1,1,1,1},
+    {26,20, 40,1,1,1,1},
+    {26,31,100,1,1,1,1}
+};
+
 const char *argp_program_version =
   "qoigconv 0.1";
 static char doc[] = 
-  "Converter to QOIG -- convert images between PNG and QOIG. Options only for converting to QOIG.";
+  "Converter to QOIG -- convert images between PNG and QOIG, or re-encode QOI and QOIG files directly. Options only for converting to QOIG.";
 static char args_doc[] =
-  "filename_to_convert filename_for_result";
+  "filename_to_convert filename_for_result\n--batch=EXT file...\n--verify file.qog\n--digest[=HEX] file.qog [source.png]\n--append file.qog rows.png";
 /* The options we understand. */
 static struct argp_option options[] = {
   {"plainqoi", 'q', 0, 0, "Use options for plain backwards-compatible QOI" },
@@ -27,11 +43,33 @@ static struct argp_option options[] = {
   {"longindex", 'i', 0, 0, "Use larger secondary color caches"},
   {"rawblocks", 'b', 0, 0, "Allow blocks of uncompressed colors"},
   {"search", 's', 0, 0, "Search entire local cache for similar colors (slower but slight compression improvement)"},
+  {"effort", 'e', "level", 0, "Effort level 1-9. Sets -c, -n, -r, -i, -b, -s and how much of the image each simulation samples, from fastest (1) to smallest (9)."},
+  {"time", 't', "seconds", 0, "Wall-clock budget for converting each file. Search effort is cut back to fit it."},
+  {"rate", 'R', "MB/s", 0, "Throughput budget in MB/s of decoded pixel data. Search effort is cut back to fit it."},
+  {"palette", 'p', 0, 0, "Seed the secondary caches with the image's palette or most common colors. Implies -i."},
+  {"dict", 'D', "file", 0, "Start the caches from a dictionary made by qoigtrain. Needed again to convert back to PNG."},
+  {"entropy", 'x', 0, 0, "Huffman code the output in blocks (QOIG+). Smaller, but not readable by plain QOI decoders."},
+  {"alpha", 'a', 0, 0, "Use 2 byte codes for pixels that change alpha (RGBA only). Not readable by plain QOI decoders."},
+  {"bigcache", 'C', "size", 0, "Also cache the last SIZE (128, 256, 512 or 1024) colors by hash, each reached by a 2 byte code. Not readable by plain QOI decoders."},
+  {"xform", 'X', 0, 0, "Code colors through a reversible YCoCg-R transform. Smaller on some drawings, usually larger on photos; with -n the simulations try it both ways. Ignored with -E. Not readable by plain QOI decoders."},
+  {"maxerror", 'E', "num", 0, "Near-lossless: let each color channel be off by up to NUM (0-255) where that codes smaller. Alpha stays exact."},
+  {"crop", 'g', "WxH+X+Y", 0, "Only convert the WxH rectangle with its top left corner at X,Y. W or H of 0 goes to the edge."},
+  {"scale", 'S', "n", 0, "Shrink the image (after cropping) by a factor of N (1-16), averaging each NxN box of pixels."},
+  {"crc", 'k', 0, 0, "Append CRC32C checksums of the output, checked when converting back to PNG."},
+  {"appendable", 'A', 0, 0, "Save the encoder state at the end of the output so rows can be added later with --append. Ignored with -x."},
+  {"append", 'U', 0, 0, "Add the rows of a PNG of the same width to the bottom of an appendable .qog file, without coding the rest over. Takes -E and -s again."},
+  {"verify", 'v', 0, 0, "Only check the checksums of a .qog file, without decoding it."},
+  {"digest", 'd', "hex", OPTION_ARG_OPTIONAL, "Decode a .qog or .qoi file and print a 64 bit hash of its pixels. Checks it against HEX if given, and each row against the source PNG if one follows the file."},
+  {"batch", 'B', "ext", 0, "Convert every file given to one of the same name with extension EXT (png, qog, or qoi)."},
+  {"jobs", 'j', "num", 0, "Number of files to convert at once in batch mode. Defaults to the number of CPUs."},
   { 0 }
 };
 struct arguments
 {
-    char *filenames[2];
+    char **filenames;
+    int nfiles;
+    char *batch;
+    int jobs;
     unsigned char longruns;
     unsigned char longindex;
     unsigned char rawblocks;
@@ -39,14 +77,66 @@ struct arguments
     unsigned char simnum;
     unsigned char plainqoi;
     unsigned char search;
+    unsigned char sample;
+    unsigned char entropy;
+    unsigned char palette;
+    unsigned char crc;
+    unsigned char verify;
+    unsigned char digest;
+    unsigned char havedigest;
+    unsigned long long want;
+    unsigned char tolerance;
+    unsigned char alpha;
+    unsigned char bigcache;
+    unsigned char xform;
+    unsigned char appendable;
+    unsigned char append;
+    qoig_view view;
+    char *dict;
+    double budget;
+    double rate;
 };
+//Settings for writing plain QOI
+static void plain_qoi(struct arguments *arguments) {
+    arguments->plainqoi = 1;
+    arguments->clen = 30;
+    arguments->longruns = 0;
+    arguments->simnum = 0;
+    arguments->search = 0;
+    arguments->rawblocks = 0;
+    arguments->entropy = 0;
+    arguments->palette = 0;
+    arguments->longindex = 0;
+    arguments->crc = 0;
+    arguments->alpha = 0;
+    arguments->bigcache = 0;
+    arguments->xform = 0;
+    arguments->appendable = 0;
+}
+
+static int known_ext(const char *name) {
+    return STR_ENDS_WITH(name,".png")||STR_ENDS_WITH(name,".qog")||STR_ENDS_WITH(name,".qoi");
+}
+
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
+    int i;
     switch (key) {
+        case 'g':
+            if (sscanf(arg,"%ux%u+%u+%u",&arguments->view.width,&arguments->view.height,
+                       &arguments->view.x,&arguments->view.y) < 2) {
+                argp_error(state,"Crop must be given as WxH+X+Y.");
+            }
+            break;
+        case 'S':
+            i = atoi(arg);
+            if (i<1||i>16) {
+                argp_error(state,"Scale must be in the range 1 to 16.");
+            }
+            arguments->view.scale = i;
+            break;
         case 'q':
-            arguments->plainqoi = 1;
-            arguments->clen = 64;
-            arguments->longruns = 0;
+            plain_qoi(arguments);
             break;
         case 'm':
             if (!arguments->plainqoi) {
@@ -113,33 +203,155 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         case 'b':
             if (!arguments->plainqoi) arguments->rawblocks = 1;
             break;
-        case ARGP_KEY_ARG:
-            if (state->arg_num >= 2) {
-                argp_error(state, "Too many arguments. Provide one input and one output filename.");
+        case 'p':
+            if (!arguments->plainqoi) {
+                arguments->palette = 1;
+                arguments->longindex = 1;
             }
-            if (!STR_ENDS_WITH(arg,".png")&&!STR_ENDS_WITH(arg,".qog")&&!STR_ENDS_WITH(arg,".qoi")) {
-                argp_error(state, "Input and output files must be .png, .qog, or .qoi");
+            break;
+        case 'D':
+            arguments->dict = arg;
+            break;
+        case 'x':
+            if (!arguments->plainqoi) arguments->entropy = 1;
+            break;
+        case 'E':
+            i = atoi(arg);
+            if (i<0||i>255) {
+                argp_error(state,"Maximum error must be in the range 0 to 255.");
+            }
+            arguments->tolerance = i;
+            break;
+        case 'k':
+            if (!arguments->plainqoi) arguments->crc = 1;
+            break;
+        case 'a':
+            if (!arguments->plainqoi) arguments->alpha = 1;
+            break;
+        case 'C':
+            i = atoi(arg);
+            if (i!=128&&i!=256&&i!=512&&i!=1024) {
+                argp_error(state,"Big cache size must be 128, 256, 512 or 1024.");
+            }
+            if (!arguments->plainqoi) {
+                for (arguments->bigcache=0;i>1;i>>=1) arguments->bigcache++;
+            }
+            break;
+        case 'X':
+            if (!arguments->plainqoi) arguments->xform = 1;
+            break;
+        case 'A':
+            if (!arguments->plainqoi) arguments->appendable = 1;
+            break;
+        case 'U':
+            arguments->append = 1;
+            break;
+        case 'v':
+            arguments->verify = 1;
+            break;
+        case 'd':
+            arguments->digest = 1;
+            if (arg) {
+                arguments->want = strtoull(arg,NULL,16);
+                arguments->havedigest = 1;
+            }
+            break;
+        case 'e':
+            if (!arguments->plainqoi) {
+                int e = atoi(arg);
+                if (e<1||e>9) {
+                    argp_error(state,"Effort level must be in the range 1 to 9.");
+                }
+                arguments->clen = efforts[e-1][0];
+                arguments->simnum = efforts[e-1][1];
+                arguments->sample = efforts[e-1][2];
+                arguments->longruns = efforts[e-1][3];
+                arguments->longindex = efforts[e-1][4];
+                arguments->rawblocks = efforts[e-1][5];
+                arguments->search = efforts[e-1][6];
+            }
+            break;
+        case 't':
+            arguments->budget = atof(arg);
+            if (arguments->budget<=0) {
+                argp_error(state,"Time budget must be positive.");
+            }
+            break;
+        case 'R':
+            arguments->rate = atof(arg);
+            if (arguments->rate<=0) {
+                argp_error(state,"Rate budget must be positive.");
+            }
+            break;
+        case 'B':
+            if (strcmp(arg,"png")&&strcmp(arg,"qog")&&strcmp(arg,"qoi")) {
+                argp_error(state,"Batch output extension must be png, qog, or qoi.");
+            }
+            arguments->batch = arg;
+            break;
+        case 'j':
+            arguments->jobs = atoi(arg);
+            if (arguments->jobs<1) {
+                argp_error(state,"Number of jobs must be at least 1.");
+            }
+            break;
+        case ARGP_KEY_ARGS:
+            arguments->filenames = state->argv+state->next;
+            arguments->nfiles = state->argc-state->next;
+            state->next = state->argc;
+            for (i=0;i<arguments->nfiles;i++) {
+                if (!known_ext(arguments->filenames[i])) {
+                    argp_error(state, "Input and output files must be .png, .qog, or .qoi");
+                }
             }
-            arguments->filenames[state->arg_num] = arg;
             break;
         case ARGP_KEY_END:
-            if (state->arg_num < 2) {
+            if (arguments->verify) {
+                if (arguments->nfiles != 1 || !STR_ENDS_WITH(arguments->filenames[0],".qog")) {
+                    argp_error(state, "Provide one .qog file to verify.");
+                }
+                break;
+            }
+            if (arguments->append) {
+                if (arguments->nfiles != 2 || !STR_ENDS_WITH(arguments->filenames[0],".qog") ||
+                    !STR_ENDS_WITH(arguments->filenames[1],".png")) {
+                    argp_error(state, "Provide an appendable .qog file and the .png to add to it.");
+                }
+                break;
+            }
+            if (arguments->digest) {
+                if (arguments->nfiles < 1 || arguments->nfiles > 2 || STR_ENDS_WITH(arguments->filenames[0],".png") ||
+                    arguments->nfiles == 2 && !STR_ENDS_WITH(arguments->filenames[1],".png")) {
+                    argp_error(state, "Provide a .qog or .qoi file, and optionally the .png it came from.");
+                }
+                break;
+            }
+            if (arguments->batch) {
+                if (!arguments->nfiles) {
+                    argp_error(state, "Provide at least one file to convert.");
+                }
+                for (i=0;i<arguments->nfiles;i++) {
+                    if (!strcmp(strrchr(arguments->filenames[i],'.')+1,arguments->batch)) {
+                        argp_error(state, "%s would be converted to itself.", arguments->filenames[i]);
+                    }
+                }
+                if (!strcmp(arguments->batch,"qoi")) {
+                    plain_qoi(arguments);
+                }
+                break;
+            }
+            if (arguments->nfiles < 2) {
                 argp_error(state, "Too few arguments. Provide one input and one output filename.");
             }
-            if (!STR_ENDS_WITH(arguments->filenames[0],".png")&&!STR_ENDS_WITH(arguments->filenames[1],".png")) {
-                argp_error(state, "Either the input file or output file must be a .png file.");
+            if (arguments->nfiles > 2) {
+                argp_error(state, "Too many arguments. Provide one input and one output filename.");
             }
             if (!STR_ENDS_WITH(arguments->filenames[0],".qog")&&!STR_ENDS_WITH(arguments->filenames[1],".qog")&&
                 !STR_ENDS_WITH(arguments->filenames[0],".qoi")&&!STR_ENDS_WITH(arguments->filenames[1],".qoi")) {
                 argp_error(state, "Either the input file or output file must be a .qoi or .qog file.");
             }
             if (STR_ENDS_WITH(arguments->filenames[1],".qoi")) {
-                arguments->plainqoi = 1;
-                arguments->clen = 64;
-                arguments->longruns = 0;
-                arguments->simnum = 0;
-                arguments->search = 0;
-                arguments->rawblocks = 0;
+                plain_qoi(arguments);
             }
             break;
 
@@ -151,45 +363,271 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = { options, parse_opt, args_doc, doc };
 
-int main(int argc, char **argv) {
+//Convert the input to QOIG or QOI, from PNG or straight from QOI/QOIG
+static size_t convert(const char *infile, const char *outfile, qoig_cfg cfg, const qoig_dict *dict) {
+    if (STR_ENDS_WITH(infile,".png")) {
+        return qoig_write(infile,outfile,cfg);
+    }
+    return qoig_transcode(infile,outfile,cfg,dict);
+}
+
+static int describe(const char *infile, qoig_desc *desc, int gray) {
+    if (STR_ENDS_WITH(infile,".png")) return qoig_png_desc(infile,desc,gray);
+    if (qoig_qog_desc(infile,desc)) return -1;
+    //Gray stays gray if allowed, otherwise it is spread over RGB
+    if (desc->channels < 3 && !gray) desc->channels += 2;
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+//Convert one file. Returns nonzero on failure.
+static int convert_file(struct arguments arguments, const char *infile, const char *outfile, const qoig_dict *dict) {
 	const char a236206[31] = {23,18,26,13,28,7,30,0,22,27,20,25,15,29,10,24,5,19,16,12,8,3,21,17,14,11,9,6,4,2,1};
-    struct arguments arguments = {0};
     qoig_cfg cfg = {0};
     char i,bestclen;
     int size;
     int compsize=INT_MAX;
+    double start = now();
+    double simtime = 0, fulltime = 0;
+    qoig_desc desc;
+    qoig_seed seed;
+    qoig_view view = arguments.view;
+    size_t pixels, sample;
     
-    
-    
-    argp_parse (&argp, argc, argv, 0, 0, &arguments);
-    
-    
-	if (STR_ENDS_WITH(arguments.filenames[0], ".png")) {
+	if (!STR_ENDS_WITH(outfile, ".png")) {
         //Encode to QOIG
         cfg.searchcache = arguments.search;
         cfg.longruns = arguments.longruns;
         cfg.longindex = arguments.longindex;
         cfg.rawblocks = arguments.rawblocks;
+        cfg.entropy = arguments.entropy;
+        cfg.crc = arguments.crc;
+        cfg.tolerance = arguments.tolerance;
+        cfg.alpha = arguments.alpha;
+        cfg.bigcache = arguments.bigcache;
+        cfg.state = arguments.appendable;
+        cfg.xform = arguments.xform;
+        cfg.view = arguments.view;
+        cfg.gray = !arguments.plainqoi;
+        if (arguments.palette && STR_ENDS_WITH(infile,".png") && !qoig_png_seed(infile,&seed)) {
+            cfg.seed = &seed;
+        }
+        if (!arguments.plainqoi) {
+            cfg.dict = dict;
+        }
         bestclen = arguments.clen;
         cfg.simulate = 1;
+        pixels = describe(infile,&desc,cfg.gray) || qoig_view_fit(&view,desc.width,desc.height) ? 0 :
+                 (size_t)QOIG_SHRUNK(view.width,view.scale)*QOIG_SHRUNK(view.height,view.scale);
+        if (arguments.rate && pixels) {
+            //Convert throughput budget into a time budget for this image, keeping -t if tighter
+            double budget = (double)pixels*desc.channels/(arguments.rate*1e6);
+            if (!arguments.budget || budget < arguments.budget) arguments.budget = budget;
+        }
+        //Effort levels sample their own share of the image in each simulation
+        if (arguments.sample) {
+            sample = pixels*arguments.sample/100;
+            cfg.bytecap = sample < 10000 ? 10000 : sample;
+        }
+        sample = cfg.bytecap ? cfg.bytecap : qoig_sample_size(pixels);
+        if (arguments.budget && cfg.searchcache && !arguments.simnum && pixels) {
+            //Nothing to simulate, so time a small sampled encode to see whether the search fits
+            sample = pixels/20 < 10000 ? 10000 : pixels/20;
+            cfg.bytecap = sample;
+            cfg.clen = bestclen;
+            convert(infile,outfile,cfg,dict);
+            simtime = now()-start;
+            fulltime = sample<pixels ? simtime*pixels/sample : simtime;
+        }
         for (i=0;i<arguments.simnum;i++) {
             if (cfg.longindex && i==6) continue;
+            //Each simulation samples a fixed fraction of the image, so its time
+            //predicts the next one and the full encode. Stop before overrunning.
+            if (arguments.budget && simtime && now()-start+simtime+fulltime > arguments.budget) break;
             cfg.clen = a236206[i];
-            size = qoig_write(arguments.filenames[0],arguments.filenames[1],cfg);
+            size = convert(infile,outfile,cfg,dict);
+            if (!simtime) {
+                simtime = now()-start;
+                fulltime = sample<pixels ? simtime*pixels/sample : simtime;
+            }
             if (size<compsize) {
                 compsize = size;
                 bestclen = cfg.clen;
             }
         }
-        if (arguments.simnum) {
+        if (cfg.xform && compsize < INT_MAX && !(arguments.budget && now()-start+simtime+fulltime > arguments.budget)) {
+            //The transform only pays off on some images, so try without it too
+            cfg.xform = 0;
+            cfg.clen = bestclen;
+            if (convert(infile,outfile,cfg,dict) >= compsize) cfg.xform = 1;
+        }
+        if (arguments.budget && cfg.searchcache && now()-start+fulltime > arguments.budget) {
+            //Not enough time left for a full search; fall back to hashed near matches only
+            cfg.searchcache = 0;
+        }
+        if (arguments.simnum && arguments.batch) {
+            printf("%s: best cache size was %d.\n",infile,bestclen);
+        } else if (arguments.simnum) {
             printf("Best cache size was %d.\n",bestclen);
         }
         cfg.simulate = 0;
         cfg.clen = bestclen;
         cfg.bytecap = 0;
-        return qoig_write(arguments.filenames[0],arguments.filenames[1],cfg)<0;
+        return convert(infile,outfile,cfg,dict) == (size_t)-1;
 	} else {
         //Decode from QOIG
-        return qoig_read(arguments.filenames[0],arguments.filenames[1])<0;
+        return qoig_read(infile,outfile,dict,arguments.view) == (size_t)-1;
+    }
+}
+
+//Files being converted in batch mode. Each worker takes the next file, asks the
+//kernel to start reading one a little further ahead, and converts its own. The
+//other workers keep the CPUs busy whenever one waits on storage.
+typedef struct {
+    struct arguments *arguments;
+    const qoig_dict *dict;
+    int next;
+    int failed;
+} batch;
+
+static void *batch_worker(void *arg) {
+    batch *b = arg;
+    struct arguments *arguments = b->arguments;
+    char *infile, *outfile, *dot;
+    int i;
+    
+    while ((i = __atomic_fetch_add(&b->next,1,__ATOMIC_RELAXED)) < arguments->nfiles) {
+        if (i+2*arguments->jobs < arguments->nfiles) {
+            qoig_prefetch(arguments->filenames[i+2*arguments->jobs]);
+        }
+        infile = arguments->filenames[i];
+        outfile = malloc(strlen(infile)+strlen(arguments->batch)+2);
+        if (outfile) {
+            strcpy(outfile,infile);
+            dot = strrchr(outfile,'.');
+            strcpy(dot+1,arguments->batch);
+        }
+        if (!outfile || convert_file(*arguments,infile,outfile,b->dict)) {
+            fprintf(stderr,"Could not convert %s\n",infile);
+            __atomic_store_n(&b->failed,1,__ATOMIC_RELAXED);
+        }
+        free(outfile);
+    }
+    return NULL;
+}
+
+static int convert_batch(struct arguments *arguments, const qoig_dict *dict) {
+    batch b = {arguments, dict, 0, 0};
+    pthread_t *threads;
+    int i, started;
+    
+    if (!arguments->jobs) {
+        arguments->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (arguments->jobs < 1) arguments->jobs = 1;
+    }
+    if (arguments->jobs > arguments->nfiles) {
+        arguments->jobs = arguments->nfiles;
+    }
+    for (i=0;i<2*arguments->jobs && i<arguments->nfiles;i++) {
+        qoig_prefetch(arguments->filenames[i]);
+    }
+    threads = malloc(sizeof(pthread_t)*arguments->jobs);
+    if (!threads) return 1;
+    for (started=0;started<arguments->jobs;started++) {
+        if (pthread_create(&threads[started],NULL,batch_worker,&b)) break;
+    }
+    if (!started) {
+        //No threads to be had, so do it all here
+        batch_worker(&b);
+    }
+    for (i=0;i<started;i++) {
+        pthread_join(threads[i],NULL);
+    }
+    free(threads);
+    return b.failed;
+}
+
+//Hash the pixels of a QOIG file, checking them against a digest or a PNG
+static int check_digest(struct arguments *arguments, const qoig_dict *dict) {
+    const char *infile = arguments->filenames[0];
+    const char *png = arguments->nfiles > 1 ? arguments->filenames[1] : NULL;
+    uint64_t digest;
+    uint32_t row;
+    int ret = qoig_digest(infile,png,dict,&digest,&row);
+    
+    switch (ret) {
+        case 0:
+            printf("%s: %016llx",infile,(unsigned long long)digest);
+            if (png) printf(", same pixels as %s",png);
+            if (arguments->havedigest && digest != arguments->want) {
+                printf(", expected %016llx",arguments->want);
+                ret = 1;
+            }
+            printf("\n");
+            break;
+        case 1:
+            printf("%s: row %u differs from %s\n",infile,row,png);
+            break;
+        case 2:
+            printf("%s: not the same size or channels as %s\n",infile,png);
+            break;
+        default:
+            printf("%s: could not be decoded%s%s\n",infile,png ? ", or could not read " : "",png ? png : "");
+    }
+    return ret != 0;
+}
+
+int main(int argc, char **argv) {
+    struct arguments arguments = {0};
+    qoig_dict dict;
+    qoig_buf buf;
+    qoig_cfg cfg = {0};
+    size_t bad;
+    int ret;
+    
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.verify) {
+        if (qoig_map(arguments.filenames[0],&buf)) {
+            fprintf(stderr,"Could not read %s\n",arguments.filenames[0]);
+            return 1;
+        }
+        ret = qoig_verify(buf.data,buf.len,&bad);
+        switch (ret) {
+            case 0:
+                printf("%s: OK\n",arguments.filenames[0]);
+                break;
+            case 1:
+                printf("%s: damaged in the %d bytes at offset %zu\n",arguments.filenames[0],QOIG_CRC_CHUNK,bad);
+                break;
+            default:
+                printf("%s: no valid checksums\n",arguments.filenames[0]);
+        }
+        qoig_unmap(&buf);
+        return ret != 0;
+    }
+    if (arguments.dict && qoig_dict_load(arguments.dict,&dict)) {
+        fprintf(stderr,"Could not read dictionary %s\n",arguments.dict);
+        return 1;
+    }
+    if (arguments.append) {
+        cfg.searchcache = arguments.search;
+        cfg.tolerance = arguments.tolerance;
+        if (qoig_append(arguments.filenames[0],arguments.filenames[1],cfg) == (size_t)-1) {
+            fprintf(stderr,"Could not append %s to %s\n",arguments.filenames[1],arguments.filenames[0]);
+            return 1;
+        }
+        return 0;
+    }
+    if (arguments.digest) {
+        return check_digest(&arguments,arguments.dict ? &dict : NULL);
+    }
+    if (arguments.batch) {
+        return convert_batch(&arguments,arguments.dict ? &dict : NULL);
     }
+    return convert_file(arguments,arguments.filenames[0],arguments.filenames[1],arguments.dict ? &dict : NULL);
 }
@@ -0,0 +1,330 @@
+//Collect a record of every codeword through the decoder's trace hook
+#include <stddef.h>
+#include <stdint.h>
+#define QOIG_TRACE(d,i,code,len,inraw,run) trace(d,(i)/(d)->cfg.channels,code,len,inraw,run)
+static void trace(const void *dec, size_t x, const uint8_t *code, size_t len, int inraw, unsigned long run);
+#include "qoig.h"
+#include <argp.h>
+#include <stdlib.h>
+
+#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+//Kinds of codeword. Indexed diffs and lumas count as their own kinds.
+enum {
+    C_RUN, C_INDEX, C_NEARDIFF, C_NEARLUMA, C_LONG1, C_LONG2DIFF, C_LONG2LUMA, C_BIG,
+    C_DIFF, C_LUMA, C_ALPHA, C_ALPHADIFF, C_RGB, C_RGBA, C_RAW, C_KINDS
+};
+static const char *kind_names[C_KINDS] = {
+    "run", "index", "index+diff", "index+luma", "long index", "long idx+diff", "long idx+luma", "big index",
+    "diff", "luma", "alpha", "alpha+diff", "rgb", "rgba", "raw block"
+};
+//Colors for the opcode map
+static const uint8_t kind_colors[C_KINDS][3] = {
+    {0,0,0}, {0,0,255}, {0,160,255}, {0,255,255}, {128,0,255}, {200,100,255}, {255,160,255}, {0,90,160},
+    {0,200,0}, {200,255,0}, {128,128,128}, {200,200,200}, {255,0,0}, {255,128,0}, {255,255,255}
+};
+
+const char *argp_program_version =
+  "qoigdump 0.1";
+static char doc[] =
+  "Look inside a QOIG or QOI file: bytes spent on each kind of codeword, use of each cache slot, "
+  "and optionally every codeword and images of where the bytes go.";
+static char args_doc[] =
+  "file.qog";
+static struct argp_option options[] = {
+  {"dump", 'd', 0, 0, "Print every codeword with the coordinates of its first pixel"},
+  {"heatmap", 'H', "file.png", 0, "Write an image of bytes per pixel in each block (white is 5 bytes per pixel or more)"},
+  {"opmap", 'O', "file.png", 0, "Write an image coloring each pixel by the kind of codeword that made it"},
+  {"block", 'b', "size", 0, "Block size for the heatmap (default 8)"},
+  {"dict", 'D', "file", 0, "Dictionary the file was encoded with"},
+  { 0 }
+};
+struct arguments
+{
+    char *infile;
+    char *heatmap;
+    char *opmap;
+    char *dict;
+    int block;
+    unsigned char dump;
+};
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+    switch (key) {
+        case 'd':
+            arguments->dump = 1;
+            break;
+        case 'H':
+            arguments->heatmap = arg;
+            break;
+        case 'O':
+            arguments->opmap = arg;
+            break;
+        case 'b':
+            arguments->block = atoi(arg);
+            if (arguments->block<1) {
+                argp_error(state,"Block size must be at least 1.");
+            }
+            break;
+        case 'D':
+            arguments->dict = arg;
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 1) {
+                argp_error(state, "Provide one file to look at.");
+            }
+            arguments->infile = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!arguments->infile) {
+                argp_error(state, "Provide one file to look at.");
+            }
+            if (arguments->heatmap && !STR_ENDS_WITH(arguments->heatmap,".png") ||
+                arguments->opmap && !STR_ENDS_WITH(arguments->opmap,".png")) {
+                argp_error(state, "Images are written as .png");
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+//What the trace hook has seen so far
+static struct {
+    uint8_t dump;
+    int block;
+    size_t bw;
+    unsigned long long codes[C_KINDS];
+    unsigned long long pixels[C_KINDS];
+    unsigned long long bytes[C_KINDS];
+    unsigned long slots[4][1024];
+    unsigned long long *heat;
+    uint8_t *kinds;
+    uint8_t runkind;
+    unsigned long long pixel;
+} st;
+
+//Work out the kind of a codeword and which cache slot it used, if any
+static int classify(const qoig_decoder *d, const uint8_t *code, int inraw, int *cache, int *slot) {
+    uint8_t b = code[0], j = code[0]&OP_ARGS;
+
+    *cache = -1;
+    if (inraw) return C_RAW;
+    if (d->cfg.channels < 3) {
+        switch (b&OP_CODE) {
+            case OP_INDEX:
+                if (d->cfg.rawblocks && j == 63) return C_RAW;
+                *cache = 0;
+                *slot = j;
+                return C_INDEX;
+            case OP_DIFF:
+                return C_DIFF;
+            case OP_LUMA:
+                return C_LUMA;
+        }
+    } else {
+        switch (b&OP_CODE) {
+            case OP_INDEX:
+                if (d->cfg.longindex && j > 61) {
+                    *cache = j-61;
+                    *slot = code[1];
+                    if (j == 62) return C_LONG1;
+                    return (code[2]&OP_CODE) == OP_LUMA ? C_LONG2LUMA : C_LONG2DIFF;
+                }
+                if (d->cfg.bigcache && j >= QOIG_NEAREND(d->cfg)) {
+                    *cache = 3;
+                    *slot = ((j-QOIG_NEAREND(d->cfg))<<8|code[1])&(1<<d->cfg.bigcache)-1;
+                    return C_BIG;
+                }
+                *cache = 0;
+                *slot = j;
+                if (j < d->clen) return C_INDEX;
+                return (code[1]&OP_CODE) == OP_LUMA ? C_NEARLUMA : C_NEARDIFF;
+            case OP_DIFF:
+                return d->cfg.rawblocks && b == OP_RGBRUN ? C_RAW : C_DIFF;
+            case OP_LUMA:
+                return C_LUMA;
+        }
+    }
+    if (d->cfg.alpha && b == OP_ALPHA) return C_ALPHA;
+    if (d->cfg.alpha && b == OP_ALPHADIFF) return C_ALPHADIFF;
+    return b == OP_RGB ? C_RGB : b == OP_RGBA ? C_RGBA : C_RUN;
+}
+
+//Charge a codeword's bytes to its first pixel and note the kind of every pixel it covers
+static void trace(const void *dec, size_t x, const uint8_t *code, size_t len, int inraw, unsigned long run) {
+    const qoig_decoder *d = dec;
+    unsigned long long p;
+    int kind, cache, slot;
+    size_t k;
+
+    kind = classify(d,code,inraw,&cache,&slot);
+    //The pixel counter may lag behind if an earlier run crossed into this row
+    st.pixel = (unsigned long long)d->y*d->desc.width+x;
+    st.codes[kind]++;
+    st.pixels[kind] += run+1;
+    st.bytes[kind] += len;
+    if (cache >= 0) st.slots[cache][slot]++;
+    if (st.heat) {
+        st.heat[(d->y/st.block)*st.bw+x/st.block] += len;
+    }
+    if (st.kinds) {
+        for (p=st.pixel;p<=st.pixel+run && p<(unsigned long long)d->desc.width*d->desc.height;p++) {
+            st.kinds[p] = kind;
+        }
+    }
+    if (st.dump) {
+        printf("%6u %6zu  %-14s",d->y,x,kind_names[kind]);
+        for (k=0;k<len;k++) printf(" %02x",code[k]);
+        if (run) printf("  x%lu",run+1);
+        printf("\n");
+    }
+}
+
+static int write_png(const char *path, const uint8_t *img, uint32_t width, uint32_t height, int color_type) {
+    struct spng_ihdr ihdr = {0};
+    FILE *f = fopen(path,"wb");
+    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
+    int ret = -1;
+
+    ihdr.width = width;
+    ihdr.height = height;
+    ihdr.bit_depth = 8;
+    ihdr.color_type = color_type;
+    if (f && ctx && !spng_set_ihdr(ctx,&ihdr) && !spng_set_png_file(ctx,f)) {
+        ret = spng_encode_image(ctx,img,(size_t)width*height*(color_type == SPNG_COLOR_TYPE_TRUECOLOR ? 3 : 1),
+                                SPNG_FMT_PNG,SPNG_ENCODE_FINALIZE) ? -1 : 0;
+    }
+    spng_ctx_free(ctx);
+    if (f && fclose(f)) ret = -1;
+    return ret;
+}
+
+//Print the hits on each slot of a cache, 16 to a line, skipping lines with none
+static void print_slots(const char *name, const unsigned long *slots, int n) {
+    unsigned long total = 0;
+    int i, j, used = 0;
+
+    for (i=0;i<n;i++) {
+        total += slots[i];
+        used += !!slots[i];
+    }
+    printf("\n%s: %lu hits on %d of %d slots\n",name,total,used,n);
+    for (i=0;i<n;i+=16) {
+        for (j=i;j<i+16 && j<n && !slots[j];j++);
+        if (j == i+16 || j == n) continue;
+        printf("  %3d:",i);
+        for (j=i;j<i+16 && j<n;j++) printf(" %6lu",slots[j]);
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    struct arguments arguments = {0};
+    qoig_dict dict;
+    qoig_buf buf;
+    qoig_decoder *d;
+    const uint8_t *in;
+    size_t len, bh, i;
+    unsigned long long codes = 0, pixels = 0, bytes = 0;
+    uint8_t *img;
+    int ret, k;
+
+    arguments.block = 8;
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.dict && qoig_dict_load(arguments.dict,&dict)) {
+        fprintf(stderr,"Could not read dictionary %s\n",arguments.dict);
+        return 1;
+    }
+    d = qoig_decoder_new();
+    if (!d || qoig_map(arguments.infile,&buf) ||
+        qoig_decoder_open(d,&buf,arguments.dict ? &dict : NULL,&in,&len)) {
+        fprintf(stderr,"Could not read %s\n",arguments.infile);
+        return 1;
+    }
+    st.dump = arguments.dump;
+    st.block = arguments.block;
+    st.bw = (d->desc.width+st.block-1)/st.block;
+    bh = (d->desc.height+st.block-1)/st.block;
+    if (arguments.heatmap && !(st.heat = calloc(st.bw*bh+1,sizeof(*st.heat))) ||
+        arguments.opmap && !(st.kinds = calloc((size_t)d->desc.width*d->desc.height+1,1))) {
+        fprintf(stderr,"Out of memory\n");
+        return 1;
+    }
+
+    printf("%s: %ux%u, %d channels, cache length %d%s%s%s%s%s%s%s%s%s%s\n",arguments.infile,
+           d->desc.width,d->desc.height,d->desc.channels,d->clen,
+           d->cfg.longruns ? ", long runs" : "", d->cfg.longindex ? ", long index" : "",
+           d->cfg.rawblocks ? ", raw blocks" : "", d->cfg.alpha ? ", alpha codes" : "",
+           d->cfg.bigcache ? ", big cache" : "", d->cfg.xform ? ", YCoCg-R" : "",
+           d->cfg.entropy ? ", entropy coded" : "",
+           d->desc.colorspace&QOIG_EXT_SEED ? ", seeded" : "", d->cfg.crc ? ", checksums" : "",
+           d->cfg.state ? ", appendable" : "");
+    if (st.dump) printf("\n     y      x  kind           bytes\n");
+    while ((ret = qoig_decoder_push(d,&in,&len)) == QOIG_ROW);
+    if (ret != QOIG_DONE) {
+        fprintf(stderr,"%s is damaged or incomplete; stats cover what could be decoded\n",arguments.infile);
+    }
+
+    printf("\n%-14s %12s %12s %12s %8s %7s\n","kind","codes","pixels","bytes","B/px","bytes%");
+    for (k=0;k<C_KINDS;k++) {
+        codes += st.codes[k];
+        pixels += st.pixels[k];
+        bytes += st.bytes[k];
+    }
+    for (k=0;k<C_KINDS;k++) {
+        if (!st.codes[k]) continue;
+        printf("%-14s %12llu %12llu %12llu %8.3f %6.2f%%\n",kind_names[k],st.codes[k],st.pixels[k],st.bytes[k],
+               (double)st.bytes[k]/st.pixels[k],bytes ? 100.0*st.bytes[k]/bytes : 0);
+    }
+    printf("%-14s %12llu %12llu %12llu %8.3f\n","total",codes,pixels,bytes,pixels ? (double)bytes/pixels : 0);
+    if (d->cfg.entropy) {
+        printf("(byte codes before entropy coding; the file is %zu bytes)\n",buf.len);
+    }
+
+    print_slots("cache",st.slots[0],64);
+    if (d->cfg.longindex) {
+        print_slots("longcache1",st.slots[1],256);
+        print_slots("longcache2",st.slots[2],256);
+    }
+    if (d->cfg.bigcache) {
+        print_slots("bigcache",st.slots[3],1<<d->cfg.bigcache);
+    }
+
+    if (arguments.heatmap) {
+        img = malloc(st.bw*bh+1);
+        for (i=0;img && i<st.bw*bh;i++) {
+            //Pixels in this block, smaller at the right and bottom edges
+            len = ((i%st.bw+1)*st.block > d->desc.width ? d->desc.width-i%st.bw*st.block : st.block)*
+                  ((i/st.bw+1)*st.block > d->desc.height ? d->desc.height-i/st.bw*st.block : st.block);
+            img[i] = st.heat[i]*51 >= 255*len ? 255 : st.heat[i]*51/len;
+        }
+        if (!img || write_png(arguments.heatmap,img,st.bw,bh,SPNG_COLOR_TYPE_GRAYSCALE)) {
+            fprintf(stderr,"Could not write %s\n",arguments.heatmap);
+        }
+        free(img);
+    }
+    if (arguments.opmap) {
+        img = malloc((size_t)d->desc.width*d->desc.height*3+1);
+        for (i=0;img && i<(size_t)d->desc.width*d->desc.height;i++) {
+            memcpy(img+3*i,kind_colors[st.kinds[i]],3);
+        }
+        if (!img || write_png(arguments.opmap,img,d->desc.width,d->desc.height,SPNG_COLOR_TYPE_TRUECOLOR)) {
+            fprintf(stderr,"Could not write %s\n",arguments.opmap);
+        }
+        free(img);
+        printf("\nopmap colors:");
+        for (k=0;k<C_KINDS;k++) {
+            printf("%s %s #%02x%02x%02x",k ? "," : "",kind_names[k],kind_colors[k][0],kind_colors[k][1],kind_colors[k][2]);
+        }
+        printf("\n");
+    }
+    qoig_unmap(&buf);
+    qoig_decoder_free(d);
+    free(st.heat);
+    free(st.kinds);
+    return ret != QOIG_DONE;
+}
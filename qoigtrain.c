@@ -0,0 +1,118 @@
+#include "qoig.h"
+#include <argp.h>
+#include <stdlib.h>
+
+#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+//Bins in the histogram shared by all samples
+#define TRAIN_HIST 65536
+
+const char *argp_program_version =
+  "qoigtrain 0.1";
+static char doc[] =
+  "Build a QOIG cache dictionary from sample PNGs of one family of images (map tiles, screenshots...). "
+  "Use it with qoigconv -D for both encoding and decoding.";
+static char args_doc[] =
+  "dictionary.qogd sample.png...";
+static struct argp_option options[] = {
+  {"id", 'i', "id", 0, "Dictionary ID stored in files that use it. Defaults to a hash of the contents."},
+  { 0 }
+};
+struct arguments
+{
+    char *dictfile;
+    char **samples;
+    int nsamples;
+    uint32_t id;
+    unsigned char haveid;
+};
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+    switch (key) {
+        case 'i':
+            arguments->id = strtoul(arg,NULL,0);
+            arguments->haveid = 1;
+            break;
+        case ARGP_KEY_ARGS:
+            arguments->dictfile = state->argv[state->next];
+            if (!STR_ENDS_WITH(arguments->dictfile,".qogd")) {
+                argp_error(state, "Dictionary file must be .qogd");
+            }
+            arguments->samples = state->argv+state->next+1;
+            arguments->nsamples = state->argc-state->next-1;
+            state->next = state->argc;
+            break;
+        case ARGP_KEY_END:
+            if (!arguments->dictfile || !arguments->nsamples) {
+                argp_error(state, "Provide a dictionary filename and at least one sample.");
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv) {
+    struct arguments arguments = {0};
+    qoig_dict dict;
+    qoig_bin *hist = calloc(TRAIN_HIST,sizeof(qoig_bin));
+    uint8_t taken1[256] = {0};
+    uint8_t taken2[256] = {0};
+    size_t used = 0;
+    const uint8_t *p;
+    uint32_t hash = 2166136261u;
+    color c;
+    int i;
+
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+    if (!hist) return 1;
+    for (i=0;i<arguments.nsamples;i++) {
+        if (qoig_png_histogram(arguments.samples[i],hist,TRAIN_HIST,&used)) {
+            fprintf(stderr,"Could not read %s\n",arguments.samples[i]);
+            return 1;
+        }
+    }
+    qsort(hist,TRAIN_HIST,sizeof(qoig_bin),qoig_bin_cmp);
+
+    //Main cache: the most common colors. Secondary caches: the most common
+    //color for each slot, keeping the built in color where no sample color lands.
+    memset(dict.cache,0,sizeof(dict.cache));
+    if (IS_BIG_ENDIAN) {
+        memcpy(dict.longcache1,default_colors_be,256*sizeof(color));
+        memcpy(dict.longcache2,default_colors2_be,256*sizeof(color));
+    } else {
+        memcpy(dict.longcache1,default_colors_le,256*sizeof(color));
+        memcpy(dict.longcache2,default_colors2_le,256*sizeof(color));
+    }
+    for (i=0;i<TRAIN_HIST && hist[i].n;i++) {
+        c = hist[i].c;
+        if (i<64) dict.cache[i] = c;
+        if (!taken1[LHASH(c)]) {
+            taken1[LHASH(c)] = 1;
+            dict.longcache1[LHASH(c)] = c;
+        }
+        if (!taken2[LOCALHASH(c,0,256)]) {
+            taken2[LOCALHASH(c,0,256)] = 1;
+            dict.longcache2[LOCALHASH(c,0,256)] = c;
+        }
+    }
+
+    if (arguments.haveid) {
+        dict.id = arguments.id;
+    } else {
+        //FNV-1a of the contents
+        for (p=(uint8_t *)dict.cache;p<(uint8_t *)dict.cache+sizeof(dict.cache);p++) hash = (hash^*p)*16777619u;
+        for (p=(uint8_t *)dict.longcache1;p<(uint8_t *)dict.longcache1+sizeof(dict.longcache1);p++) hash = (hash^*p)*16777619u;
+        for (p=(uint8_t *)dict.longcache2;p<(uint8_t *)dict.longcache2+sizeof(dict.longcache2);p++) hash = (hash^*p)*16777619u;
+        dict.id = hash;
+    }
+    if (qoig_dict_save(arguments.dictfile,&dict)) {
+        fprintf(stderr,"Could not write %s\n",arguments.dictfile);
+        return 1;
+    }
+    printf("Dictionary %08x: %zu colors from %d samples.\n",dict.id,used,arguments.nsamples);
+    free(hist);
+    return 0;
+}